@@ -24,13 +24,47 @@
 #define usToTicks(_us)    ((clockCyclesPerMicrosecond() * _us) / 16)                 // converts microseconds to ticks
 #define ticksToUs(_ticks) (((unsigned) _ticks * 16) / clockCyclesPerMicrosecond())   // converts from ticks back to microseconds
 
-#define TRIM_DURATION  5                                   // compensation ticks to trim adjust for digitalWrite delays
+#define TRIM_DURATION  0                                   // compensation in us for pin write delays; port writes are done with equal latency for both edges
 
 static servo_t servos[MAX_SERVOS];                         // static array of servo structures
+static servoMove_t moves[MAX_SERVOS];                      // background moves of the servos
 
 uint8_t ServoCount = 0;                                    // the total number of attached servos
 
 static volatile int8_t currentServoIndex[_Nbr_16timers];   // index for the servo being pulsed for each timer (or -1 if refresh interval)
+static volatile uint16_t frameStart[_Nbr_16timers];        // compare value at the start of the current frame (the counter is never reset)
+static volatile uint32_t frameTicks[_Nbr_16timers];        // pulse ticks scheduled in the current frame
+
+// simultaneous scheduling: falling edges sorted by pulse width, servos with (nearly) equal width share an edge
+#define SERVO_PORT_GROUPS      2                           // PORTA, PORTB
+#define MIN_EDGE_GAP          16                           // ticks between two edges, closer edges are merged (about 5 us)
+#define EDGE_MARGIN            8                           // ticks a compare must be ahead of the counter, else the edge is done at once
+#define EDGE_WAIT_LOOPS      (EDGE_MARGIN * 16)            // bound of the wait for such an edge: a loop takes more than 1 of the 16 CPU cycles per tick
+
+typedef struct {
+  uint16_t ticks;                                          // falling edge after frame start
+  uint32_t bitMask[SERVO_PORT_GROUPS];                     // pins going low at this edge
+} servoEdge_t;
+
+static servoEdge_t edges[_Nbr_16timers][SERVOS_PER_TIMER];
+static uint8_t edgeCount[_Nbr_16timers];
+static uint32_t raiseMask[_Nbr_16timers][SERVO_PORT_GROUPS];   // pins going high at frame start
+static volatile bool edgesDirty[_Nbr_16timers];            // a pulse width changed since the edges were built
+static volatile uint8_t scheduleMode = SCHEDULE_SEQUENTIAL;
+static uint8_t frameMode[_Nbr_16timers];                   // mode of the current frame
+
+// group updates: writes go to the back buffer, one interrupt swaps the buffers of all servos at the end of its frame
+static volatile uint8_t liveIdx = 0;                       // buffer of servo_t.ticks used for the pulses
+static volatile bool pending = false;                      // back buffer complete, swap at the next frame end of swapTimer
+static volatile uint16_t swapCount = 0;
+static uint16_t syncedSwaps = 0;                           // swapCount when the back buffer was last made equal to the live one
+static volatile int8_t swapTimer = -1;                     // timer whose frame end swaps the buffers, -1 if no timer interrupt runs
+static volatile bool holdSwap = false;                     // between beginUpdate() and commit(): no swap
+static volatile bool updating = false;                     // group is collected: writes and moves go to the back buffer only
+static volatile bool touched = false;                      // a servo was written or stepped since beginUpdate()
+
+#define LIVE_TICKS(_servo_nbr) (servos[_servo_nbr].ticks[liveIdx])
+#define BACK_TICKS(_servo_nbr) (servos[_servo_nbr].ticks[liveIdx ^ 1])
 
 // convenience macros
 #define SERVO_INDEX_TO_TIMER(_servo_nbr) ((timer16_Sequence_t)(_servo_nbr / SERVOS_PER_TIMER))   // returns the timer controlling this servo
@@ -43,28 +77,219 @@ static volatile int8_t currentServoIndex[_Nbr_16timers];   // index for the serv
 
 #define WAIT_TC16_REGS_SYNC(x) while(x->COUNT16.STATUS.bit.SYNCBUSY);
 
+#define WAIT_TCC_REGS_SYNC(x) while(x->SYNCBUSY.reg & TCC_SYNCBUSY_MASK);
+
+// hardware PWM: PA06 and PA07 are TCC1 WO[0] and WO[1] with peripheral function E
+#define TCC_FOR_SERVOS         TCC1
+#define IRQn_FOR_TCC_SERVOS    TCC1_IRQn
+#define HANDLER_FOR_TCC_SERVOS TCC1_Handler
+#define GCM_FOR_TCC_SERVOS     GCM_TCC0_TCC1
+#define TCC_SERVO_CHANNELS     2
+
+static uint8_t tccServo[TCC_SERVO_CHANNELS] = {INVALID_SERVO, INVALID_SERVO};   // servo index of each TCC channel
+
+// pin writes in the interrupt: port register with the pin data stored by attach(), no pin table lookup
+#define SERVO_PIN_HIGH(_servo) (PORT->Group[(_servo).port].OUTSET.reg = (_servo).bitMask)
+#define SERVO_PIN_LOW(_servo)  (PORT->Group[(_servo).port].OUTCLR.reg = (_servo).bitMask)
+
 /************ static functions common to all instances ***********************/
 
+static inline void setStepTicks(uint8_t index, unsigned int ticks)
+{
+    // while a group is collected the step goes to the back buffer only, so the group carries the moving servos along
+    servos[index].ticks[liveIdx ^ 1] = ticks;
+    if (updating)
+        touched = true;
+    else
+        servos[index].ticks[liveIdx] = ticks;
+}
+
+static bool stepMove(uint8_t index)
+{
+    // next position of a moving servo, returns true if the pulse width changed
+    servoMove_t *m = &moves[index];
+    if (!m->active)
+        return false;
+    m->fraction += m->step;
+    if (m->fraction >= (1UL << 24)) {
+        setStepTicks(index, m->targetTicks);
+        m->active = false;
+        return true;
+    }
+    uint32_t f = m->fraction >> 14;                           // fraction of the move 0 ... 1024
+    if (m->profile == MOVE_EASED)
+        f = (f * f * (3072UL - 2 * f)) >> 20;                 // smoothstep 3f^2 - 2f^3
+    setStepTicks(index, m->startTicks + ((m->delta * (int32_t) f) >> 10));
+    return true;
+}
+
+static void swapTicks()
+{
+    // called at the end of a frame of swapTimer: a committed group becomes live for all servos at once
+    if (!pending || holdSwap)
+        return;   // a group still being collected is swapped after its commit()
+    liveIdx ^= 1;
+    swapCount++;
+    pending = false;
+    for (uint8_t t = 0; t < _Nbr_16timers; t++)
+        edgesDirty[t] = true;   // every timer pulses the new widths from its next pulse on
+    if (tccServo[0] != INVALID_SERVO || tccServo[1] != INVALID_SERVO) {
+        // hardware PWM servos: lock the buffered compare values so both channels change at the same overflow
+        TCC_FOR_SERVOS->CTRLBSET.reg = TCC_CTRLBSET_LUPD;
+        WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+        for (uint8_t channel = 0; channel < TCC_SERVO_CHANNELS; channel++)
+            if (tccServo[channel] != INVALID_SERVO)
+                TCC_FOR_SERVOS->CCB[channel].reg = LIVE_TICKS(tccServo[channel]);
+        TCC_FOR_SERVOS->CTRLBCLR.reg = TCC_CTRLBCLR_LUPD;
+        WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+    }
+}
+
+static void stepMoves(timer16_Sequence_t timer)
+{
+    // called once per refresh frame: all moving servos pulsed by this timer
+    for (uint8_t channel = 0; channel < SERVOS_PER_TIMER; channel++) {
+        if (!SERVO(timer, channel).Pin.isHardware && stepMove(SERVO_INDEX(timer, channel)))
+            edgesDirty[timer] = true;
+    }
+}
+
+void HANDLER_FOR_TCC_SERVOS(void)
+{
+    // overflow once per frame: buffered compare values of moving servos are taken over at the next overflow
+    for (uint8_t channel = 0; channel < TCC_SERVO_CHANNELS; channel++) {
+        uint8_t index = tccServo[channel];
+        if (index != INVALID_SERVO && stepMove(index))
+            TCC_FOR_SERVOS->CCB[channel].reg = LIVE_TICKS(index);
+    }
+    TCC_FOR_SERVOS->INTFLAG.reg = TCC_INTFLAG_OVF;
+}
+
+static void buildEdges(timer16_Sequence_t timer)
+{
+    // insertion sort of the active servos by pulse width - called between frames only
+    servoEdge_t *e = edges[timer];
+    uint8_t count = 0;
+    edgesDirty[timer] = false;
+    for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+        raiseMask[timer][g] = 0;
+    for (uint8_t channel = 0; channel < SERVOS_PER_TIMER && SERVO_INDEX(timer, channel) < ServoCount; channel++) {
+        servo_t *s = &SERVO(timer, channel);
+        if (!s->Pin.isActive || s->Pin.isHardware)
+            continue;
+        uint16_t ticks = s->ticks[liveIdx];
+        uint8_t i = count;
+        for (; i > 0 && e[i - 1].ticks > ticks; i--)
+            e[i] = e[i - 1];
+        e[i].ticks = ticks;
+        for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+            e[i].bitMask[g] = 0;
+        e[i].bitMask[s->port] = s->bitMask;
+        raiseMask[timer][s->port] |= s->bitMask;
+        count++;
+    }
+    // merge edges too close for two interrupts
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (n > 0 && e[i].ticks - e[n - 1].ticks < MIN_EDGE_GAP) {
+            for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+                e[n - 1].bitMask[g] |= e[i].bitMask[g];
+        }
+        else
+            e[n++] = e[i];
+    }
+    edgeCount[timer] = n;
+}
+
+static void Sorted_Handler(timer16_Sequence_t timer, Tc *tc, uint8_t channel, uint8_t intFlag, uint16_t compareValue)
+{
+    // frame start: all pins high, then one compare per falling edge
+    int8_t edge = currentServoIndex[timer];
+    if (edge < 0) {
+        frameStart[timer] = compareValue;
+        for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+            if (raiseMask[timer][g])
+                PORT->Group[g].OUTSET.reg = raiseMask[timer][g];
+        edge = 0;
+    } else {
+        for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+            if (edges[timer][edge].bitMask[g])
+                PORT->Group[g].OUTCLR.reg = edges[timer][edge].bitMask[g];
+        edge++;
+    }
+
+    while (edge < edgeCount[timer]) {
+        uint16_t ticks = edges[timer][edge].ticks;
+        tc->COUNT16.CC[channel].reg = (uint16_t) (frameStart[timer] + ticks);
+        WAIT_TC16_REGS_SYNC(tc)
+
+        // the other channel of the TC may have delayed this interrupt: an edge already due would be missed until the counter wraps
+        uint16_t elapsed = (uint16_t) (tc->COUNT16.COUNT.reg - frameStart[timer]);
+        WAIT_TC16_REGS_SYNC(tc)
+        if (elapsed + EDGE_MARGIN < ticks) {
+            currentServoIndex[timer] = edge;
+            return;
+        }
+        for (uint16_t n = 0; n < EDGE_WAIT_LOOPS && (uint16_t) (tc->COUNT16.COUNT.reg - frameStart[timer]) < ticks; n++);   // EDGE_MARGIN ticks at most
+        for (uint8_t g = 0; g < SERVO_PORT_GROUPS; g++)
+            if (edges[timer][edge].bitMask[g])
+                PORT->Group[g].OUTCLR.reg = edges[timer][edge].bitMask[g];
+        tc->COUNT16.INTFLAG.reg = intFlag;   // the match of this edge is served here
+        edge++;
+    }
+
+    // last edge: the frame is always REFRESH_INTERVAL long
+    tc->COUNT16.CC[channel].reg = (uint16_t) (frameStart[timer] + usToTicks(REFRESH_INTERVAL));
+    WAIT_TC16_REGS_SYNC(tc)
+    currentServoIndex[timer] = -1;
+    if (timer == swapTimer)
+        swapTicks();
+    stepMoves(timer);
+    if (edgesDirty[timer])
+        buildEdges(timer);   // new widths apply from the next frame
+}
+
 void Servo_Handler(timer16_Sequence_t timer, Tc *pTc, uint8_t channel, uint8_t intFlag);
 #if defined (_useTimer1)
 void HANDLER_FOR_TIMER1(void) {
-    Servo_Handler(_timer1, TC_FOR_TIMER1, CHANNEL_FOR_TIMER1, INTFLAG_BIT_FOR_TIMER_1);
+    // timers 1 and 2 are the two compare channels of one TC: serve each enabled channel with a pending request
+    uint8_t flags = TC_FOR_TIMER1->COUNT16.INTFLAG.reg & TC_FOR_TIMER1->COUNT16.INTENSET.reg;
+    if (flags & INTFLAG_BIT_FOR_TIMER_1)
+        Servo_Handler(_timer1, TC_FOR_TIMER1, CHANNEL_FOR_TIMER1, INTFLAG_BIT_FOR_TIMER_1);
+#if defined (_useTimer2)
+    if (flags & INTFLAG_BIT_FOR_TIMER_2)
+        Servo_Handler(_timer2, TC_FOR_TIMER2, CHANNEL_FOR_TIMER2, INTFLAG_BIT_FOR_TIMER_2);
+#endif
 }
 #endif
-#if defined (_useTimer2)
-void HANDLER_FOR_TIMER2(void) {
-    Servo_Handler(_timer2, TC_FOR_TIMER2, CHANNEL_FOR_TIMER2, INTFLAG_BIT_FOR_TIMER_2);
+#if defined (_useTimer3)
+void HANDLER_FOR_TIMER3(void) {
+    Servo_Handler(_timer3, TC_FOR_TIMER3, CHANNEL_FOR_TIMER3, INTFLAG_BIT_FOR_TIMER_3);
 }
 #endif
 
 void Servo_Handler(timer16_Sequence_t timer, Tc *tc, uint8_t channel, uint8_t intFlag)
 {
+    // the next compare value is set relative to this one, so interrupt latency does not add up
+    uint16_t compareValue = tc->COUNT16.CC[channel].reg;
+
+    // clear the interrupt before the next compare is set: a match while still in here must not be lost
+    tc->COUNT16.INTFLAG.reg = intFlag;
+
+    if (currentServoIndex[timer] < 0)
+        frameMode[timer] = scheduleMode;   // the mode changes at a frame boundary only
+    if (frameMode[timer] == SCHEDULE_SIMULTANEOUS) {
+        Sorted_Handler(timer, tc, channel, intFlag, compareValue);
+        return;
+    }
+
     if (currentServoIndex[timer] < 0) {
-        tc->COUNT16.COUNT.reg = (uint16_t) 0;
-        WAIT_TC16_REGS_SYNC(tc)
+        frameStart[timer] = compareValue;
+        frameTicks[timer] = 0;
     } else {
-        if (SERVO_INDEX(timer, currentServoIndex[timer]) < ServoCount && SERVO(timer, currentServoIndex[timer]).Pin.isActive == true) {
-            digitalWrite(SERVO(timer, currentServoIndex[timer]).Pin.nbr, LOW);   // pulse this channel low if activated
+        if (SERVO_INDEX(timer, currentServoIndex[timer]) < ServoCount && SERVO(timer, currentServoIndex[timer]).Pin.isActive == true
+            && !SERVO(timer, currentServoIndex[timer]).Pin.isHardware) {
+            SERVO_PIN_LOW(SERVO(timer, currentServoIndex[timer]));   // pulse this channel low if activated
         }
     }
 
@@ -72,37 +297,38 @@ void Servo_Handler(timer16_Sequence_t timer, Tc *tc, uint8_t channel, uint8_t in
     currentServoIndex[timer]++;
 
     if (SERVO_INDEX(timer, currentServoIndex[timer]) < ServoCount && currentServoIndex[timer] < SERVOS_PER_TIMER) {
-        if (SERVO(timer, currentServoIndex[timer]).Pin.isActive == true) {   // check if activated
-            digitalWrite(SERVO(timer, currentServoIndex[timer]).Pin.nbr, HIGH);   // it's an active channel so pulse it high
+        if (SERVO(timer, currentServoIndex[timer]).Pin.isActive == true && !SERVO(timer, currentServoIndex[timer]).Pin.isHardware) {   // check if activated
+            SERVO_PIN_HIGH(SERVO(timer, currentServoIndex[timer]));   // it's an active channel so pulse it high
         }
 
-        // Get the counter value
-        uint16_t tcCounterValue = tc->COUNT16.COUNT.reg;
-        WAIT_TC16_REGS_SYNC(tc)
-
-        tc->COUNT16.CC[channel].reg = (uint16_t) (tcCounterValue + SERVO(timer, currentServoIndex[timer]).ticks);
+        unsigned int ticks = SERVO(timer, currentServoIndex[timer]).ticks[liveIdx];
+        tc->COUNT16.CC[channel].reg = (uint16_t) (compareValue + ticks);
         WAIT_TC16_REGS_SYNC(tc)
+        frameTicks[timer] += ticks;
     }
     else {
         // finished all channels so wait for the refresh period to expire before starting over
 
-        // Get the counter value
-        uint16_t tcCounterValue = tc->COUNT16.COUNT.reg;
-        WAIT_TC16_REGS_SYNC(tc)
-
-        if (tcCounterValue + 4UL < usToTicks(REFRESH_INTERVAL)) {   // allow a few ticks to ensure the next OCR1A not missed
-            tc->COUNT16.CC[channel].reg = (uint16_t) usToTicks(REFRESH_INTERVAL);
+        if (frameTicks[timer] + 4UL < usToTicks(REFRESH_INTERVAL)) {   // allow a few ticks to ensure the next compare is not missed
+            tc->COUNT16.CC[channel].reg = (uint16_t) (frameStart[timer] + usToTicks(REFRESH_INTERVAL));
         }
         else {
+            // Get the counter value
+            uint16_t tcCounterValue = tc->COUNT16.COUNT.reg;
+            WAIT_TC16_REGS_SYNC(tc)
+
             tc->COUNT16.CC[channel].reg = (uint16_t) (tcCounterValue + 4UL);   // at least REFRESH_INTERVAL has elapsed
         }
         WAIT_TC16_REGS_SYNC(tc)
 
         currentServoIndex[timer] = -1;   // this will get incremented at the end of the refresh period to start again at the first channel
-    }
 
-    // Clear the interrupt
-    tc->COUNT16.INTFLAG.reg = intFlag;
+        if (timer == swapTimer)
+            swapTicks();
+        stepMoves(timer);
+        if (scheduleMode == SCHEDULE_SIMULTANEOUS && edgesDirty[timer])
+            buildEdges(timer);   // prepare the switch to simultaneous scheduling
+    }
 }
 
 static inline void resetTC (Tc* TCx)
@@ -117,14 +343,38 @@ static inline void resetTC (Tc* TCx)
     while (TCx->COUNT16.CTRLA.bit.SWRST);
 }
 
+static inline void syncCount(Tc *tc)
+{
+    // the interrupt reads COUNT: without continuous read synchronization it returns the last synchronized value
+    tc->COUNT16.READREQ.reg = TC_READREQ_RREQ | TC_READREQ_RCONT | TC_READREQ_ADDR(TC_COUNT16_COUNT_OFFSET);
+    WAIT_TC16_REGS_SYNC(tc)
+}
+
 static void _initISR(Tc *tc, uint8_t channel, uint32_t id, IRQn_Type irqn, uint8_t gcmForTimer, uint8_t intEnableBit)
 {
+    // analogWrite() leaves a TC running in 8-bit mode with its own prescaler, so enabled is not enough
+    if (tc->COUNT16.CTRLA.bit.ENABLE
+        && (tc->COUNT16.CTRLA.reg & TC_CTRLA_MODE_Msk) == TC_CTRLA_MODE_COUNT16
+        && (tc->COUNT16.CTRLA.reg & TC_CTRLA_WAVEGEN_Msk) == TC_CTRLA_WAVEGEN_NPWM
+        && (tc->COUNT16.CTRLA.reg & TC_CTRLA_PRESCALER_Msk) == TC_CTRLA_PRESCALER_DIV16) {
+        // The timer already runs for its other channel: keep it running and just add this channel
+        syncCount(tc);
+        uint16_t tcCounterValue = tc->COUNT16.COUNT.reg;
+        WAIT_TC16_REGS_SYNC(tc)
+
+        tc->COUNT16.CC[channel].reg = (uint16_t) (tcCounterValue + usToTicks(1000UL));
+        WAIT_TC16_REGS_SYNC(tc)
+
+        tc->COUNT16.INTFLAG.reg = intEnableBit;   // the match flag has the same bit as its interrupt enable
+        tc->COUNT16.INTENSET.reg = intEnableBit;
+        return;
+    }
+
     // Enable GCLK for timer 1 (timer counter input clock)
     GCLK->CLKCTRL.reg = (uint16_t) (GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(gcmForTimer));
     while (GCLK->STATUS.bit.SYNCBUSY);
 
     // Reset the timer
-    // TODO this is not the right thing to do if more than one channel per timer is used by the Servo library
     resetTC(tc);
 
     // Set timer counter mode to 16 bits
@@ -145,7 +395,6 @@ static void _initISR(Tc *tc, uint8_t channel, uint32_t id, IRQn_Type irqn, uint8
     WAIT_TC16_REGS_SYNC(tc)
 
     // Configure interrupt request
-    // TODO this should be changed if more than one channel per timer is used by the Servo library
     NVIC_DisableIRQ(irqn);
     NVIC_ClearPendingIRQ(irqn);
     NVIC_SetPriority(irqn, 0);
@@ -157,10 +406,12 @@ static void _initISR(Tc *tc, uint8_t channel, uint32_t id, IRQn_Type irqn, uint8
     // Enable the timer and start it
     tc->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
     WAIT_TC16_REGS_SYNC(tc)
+    syncCount(tc);
 }
 
 static void initISR(timer16_Sequence_t timer)
 {
+    currentServoIndex[timer] = -1;   // first interrupt starts a frame
 #if defined (_useTimer1)
     if (timer == _timer1)
         _initISR(TC_FOR_TIMER1, CHANNEL_FOR_TIMER1, ID_TC_FOR_TIMER1, IRQn_FOR_TIMER1, GCM_FOR_TIMER_1, INTENSET_BIT_FOR_TIMER_1);
@@ -169,37 +420,149 @@ static void initISR(timer16_Sequence_t timer)
     if (timer == _timer2)
         _initISR(TC_FOR_TIMER2, CHANNEL_FOR_TIMER2, ID_TC_FOR_TIMER2, IRQn_FOR_TIMER2, GCM_FOR_TIMER_2, INTENSET_BIT_FOR_TIMER_2);
 #endif
+#if defined (_useTimer3)
+    if (timer == _timer3)
+        _initISR(TC_FOR_TIMER3, CHANNEL_FOR_TIMER3, ID_TC_FOR_TIMER3, IRQn_FOR_TIMER3, GCM_FOR_TIMER_3, INTENSET_BIT_FOR_TIMER_3);
+#endif
 }
 
 static void finISR(timer16_Sequence_t timer)
 {
+    // Disable the match channel interrupt request of this timer only; the TC keeps running for its other channel
 #if defined (_useTimer1)
-    // Disable the match channel interrupt request
-    TC_FOR_TIMER1->COUNT16.INTENCLR.reg = INTENCLR_BIT_FOR_TIMER_1;
+    if (timer == _timer1)
+        TC_FOR_TIMER1->COUNT16.INTENCLR.reg = INTENCLR_BIT_FOR_TIMER_1;
 #endif
 #if defined (_useTimer2)
-    // Disable the match channel interrupt request
-    TC_FOR_TIMER2->COUNT16.INTENCLR.reg = INTENCLR_BIT_FOR_TIMER_2;
+    if (timer == _timer2)
+        TC_FOR_TIMER2->COUNT16.INTENCLR.reg = INTENCLR_BIT_FOR_TIMER_2;
+#endif
+#if defined (_useTimer3)
+    if (timer == _timer3)
+        TC_FOR_TIMER3->COUNT16.INTENCLR.reg = INTENCLR_BIT_FOR_TIMER_3;
 #endif
 }
 
 static boolean isTimerActive(timer16_Sequence_t timer)
 {
-  // returns true if any servo is active on this timer
+  // returns true if any servo is active on this timer; hardware PWM servos don't need the timer
   for(uint8_t channel=0; channel < SERVOS_PER_TIMER; channel++) {
-    if(SERVO(timer,channel).Pin.isActive == true)
+    if(SERVO(timer,channel).Pin.isActive == true && !SERVO(timer,channel).Pin.isHardware)
       return true;
   }
   return false;
 }
 
+static void updateSwapTimer()
+{
+  // the first timer with a running interrupt swaps the buffers for all servos
+  int8_t timer = -1;
+  for (uint8_t t = 0; t < _Nbr_16timers && timer < 0; t++)
+    if (isTimerActive((timer16_Sequence_t) t))
+      timer = t;
+  swapTimer = timer;
+  if (timer < 0)
+    swapTicks();   // no interrupt left: a committed group is applied at once
+}
+
+static int8_t tccChannel(int pin)
+{
+  // TCC channel for a pin with hardware PWM or -1
+  if (g_APinDescription[pin].ulPort == PORTA && (g_APinDescription[pin].ulPin == 6 || g_APinDescription[pin].ulPin == 7))
+    return g_APinDescription[pin].ulPin - 6;
+  return -1;
+}
+
+static void initTCC()
+{
+    // analogWrite() on pin 8/9 leaves TCC1 running with its own period, so enabled is not enough
+    if (TCC_FOR_SERVOS->CTRLA.bit.ENABLE
+        && (TCC_FOR_SERVOS->CTRLA.reg & TCC_CTRLA_PRESCALER_Msk) == TCC_CTRLA_PRESCALER_DIV16
+        && (TCC_FOR_SERVOS->WAVE.reg & TCC_WAVE_WAVEGEN_Msk) == TCC_WAVE_WAVEGEN_NPWM
+        && TCC_FOR_SERVOS->PER.reg == usToTicks(REFRESH_INTERVAL) - 1
+        && (TCC_FOR_SERVOS->INTENSET.reg & TCC_INTENSET_OVF))
+        return;                                             // already set up for servos
+
+    // Enable GCLK for the TCC (timer counter input clock)
+    GCLK->CLKCTRL.reg = (uint16_t) (GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(GCM_FOR_TCC_SERVOS));
+    while (GCLK->STATUS.bit.SYNCBUSY);
+
+    // Reset the timer
+    TCC_FOR_SERVOS->CTRLA.reg = TCC_CTRLA_SWRST;
+    WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+    while (TCC_FOR_SERVOS->CTRLA.bit.SWRST);
+
+    // GCLK_TCC/16 gives the same 3000 ticks per millisecond as the servo timers, 20 ms period
+    TCC_FOR_SERVOS->CTRLA.reg = TCC_CTRLA_PRESCALER_DIV16;
+    TCC_FOR_SERVOS->WAVE.reg = TCC_WAVE_WAVEGEN_NPWM;
+    WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+    TCC_FOR_SERVOS->PER.reg = usToTicks(REFRESH_INTERVAL) - 1;
+    WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+
+    // Overflow interrupt steps the trajectories; it does not touch the pulses, so it may wait
+    NVIC_DisableIRQ(IRQn_FOR_TCC_SERVOS);
+    NVIC_ClearPendingIRQ(IRQn_FOR_TCC_SERVOS);
+    NVIC_SetPriority(IRQn_FOR_TCC_SERVOS, 1);
+    NVIC_EnableIRQ(IRQn_FOR_TCC_SERVOS);
+    TCC_FOR_SERVOS->INTENSET.reg = TCC_INTENSET_OVF;
+
+    TCC_FOR_SERVOS->CTRLA.reg |= TCC_CTRLA_ENABLE;
+    WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+}
+
+static void attachTCC(uint8_t index, int pin, int8_t channel)
+{
+    uint32_t port = g_APinDescription[pin].ulPort;
+    uint32_t bit = g_APinDescription[pin].ulPin;
+
+    initTCC();
+    tccServo[channel] = index;
+    TCC_FOR_SERVOS->CC[channel].reg = LIVE_TICKS(index);
+    WAIT_TCC_REGS_SYNC(TCC_FOR_SERVOS)
+
+    // Connect the pin to the TCC output (peripheral function E)
+    if (bit & 1)
+        PORT->Group[port].PMUX[bit >> 1].reg = (PORT->Group[port].PMUX[bit >> 1].reg & 0x0F) | PORT_PMUX_PMUXO_E;
+    else
+        PORT->Group[port].PMUX[bit >> 1].reg = (PORT->Group[port].PMUX[bit >> 1].reg & 0xF0) | PORT_PMUX_PMUXE_E;
+    PORT->Group[port].PINCFG[bit].reg |= PORT_PINCFG_PMUXEN;
+}
+
+static void detachTCC(uint8_t index)
+{
+    for (uint8_t channel = 0; channel < TCC_SERVO_CHANNELS; channel++) {
+        if (tccServo[channel] == index) {
+            tccServo[channel] = INVALID_SERVO;
+            SERVO_PIN_LOW(servos[index]);
+            PORT->Group[servos[index].port].PINCFG[g_APinDescription[servos[index].Pin.nbr].ulPin].reg &= ~PORT_PINCFG_PMUXEN;   // back to the output low
+        }
+    }
+}
+
+static void setTicks(uint8_t index, unsigned int ticks)
+{
+  timer16_Sequence_t timer = SERVO_INDEX_TO_TIMER(index);
+  if (updating) {   // group update: applied by commit()
+    BACK_TICKS(index) = ticks;
+    touched = true;
+    return;
+  }
+  servos[index].ticks[0] = servos[index].ticks[1] = ticks;
+  edgesDirty[timer] = true;
+  if (servos[index].Pin.isActive && servos[index].Pin.isHardware) {
+    for (uint8_t channel = 0; channel < TCC_SERVO_CHANNELS; channel++)
+      if (tccServo[channel] == index)
+        TCC_FOR_SERVOS->CCB[channel].reg = ticks;   // taken over at the next overflow, no cut pulse
+  }
+}
+
 /****************** end of static functions ******************************/
 
 Servo::Servo()
 {
   if (ServoCount < MAX_SERVOS) {
     this->servoIndex = ServoCount++;                    // assign a servo index to this instance
-    servos[this->servoIndex].ticks = usToTicks(DEFAULT_PULSE_WIDTH);   // store default values
+    servos[this->servoIndex].ticks[0] = servos[this->servoIndex].ticks[1] = usToTicks(DEFAULT_PULSE_WIDTH);   // store default values
   } else {
     this->servoIndex = INVALID_SERVO;  // too many servos
   }
@@ -215,17 +578,39 @@ uint8_t Servo::attach(int pin, int min, int max)
   timer16_Sequence_t timer;
 
   if (this->servoIndex < MAX_SERVOS) {
-    pinMode(pin, OUTPUT);                                   // set servo pin to output
-    servos[this->servoIndex].Pin.nbr = pin;
     // todo min/max check: abs(min - MIN_PULSE_WIDTH) /4 < 128
     this->min  = (MIN_PULSE_WIDTH - min)/4; //resolution of min/max is 4 us
     this->max  = (MAX_PULSE_WIDTH - max)/4;
-    // initialize the timer if it has not already been initialized
+    if (servos[this->servoIndex].Pin.isActive && servos[this->servoIndex].Pin.isHardware && servos[this->servoIndex].Pin.nbr == pin)
+      return this->servoIndex;                              // already pulsed by hardware PWM
+    pinMode(pin, OUTPUT);                                   // set servo pin to output
+    servos[this->servoIndex].Pin.nbr = pin;
+    servos[this->servoIndex].port = g_APinDescription[pin].ulPort;
+    servos[this->servoIndex].bitMask = 1ul << g_APinDescription[pin].ulPin;
     timer = SERVO_INDEX_TO_TIMER(servoIndex);
+    int8_t channel = tccChannel(pin);
+    if (channel >= 0 && (tccServo[channel] == INVALID_SERVO || tccServo[channel] == this->servoIndex)) {
+      // hardware PWM, the servo timer is not needed
+      bool wasPulsedByTimer = servos[this->servoIndex].Pin.isActive && !servos[this->servoIndex].Pin.isHardware;
+      servos[this->servoIndex].Pin.isHardware = true;
+      attachTCC(this->servoIndex, pin, channel);
+      servos[this->servoIndex].Pin.isActive = true;
+      edgesDirty[timer] = true;
+      if (wasPulsedByTimer && isTimerActive(timer) == false)
+        finISR(timer);
+      updateSwapTimer();
+      return this->servoIndex;
+    }
+    if (servos[this->servoIndex].Pin.isHardware)
+      detachTCC(this->servoIndex);                          // pin changed
+    servos[this->servoIndex].Pin.isHardware = false;
+    // initialize the timer if it has not already been initialized
     if (isTimerActive(timer) == false) {
       initISR(timer);
     }
     servos[this->servoIndex].Pin.isActive = true;  // this must be set after the check for isTimerActive
+    edgesDirty[timer] = true;
+    updateSwapTimer();
   }
   return this->servoIndex;
 }
@@ -234,11 +619,17 @@ void Servo::detach()
 {
   timer16_Sequence_t timer;
 
+  moves[this->servoIndex].active = false;
   servos[this->servoIndex].Pin.isActive = false;
+  if (servos[this->servoIndex].Pin.isHardware) {
+    detachTCC(this->servoIndex);
+    servos[this->servoIndex].Pin.isHardware = false;
+  }
   timer = SERVO_INDEX_TO_TIMER(servoIndex);
-  if(isTimerActive(timer) == false) {
+  edgesDirty[timer] = true;
+  if(isTimerActive(timer) == false)
     finISR(timer);
-  }
+  updateSwapTimer();   // another timer takes over the swaps, or a committed group is applied at once
 }
 
 void Servo::write(int value)
@@ -262,15 +653,91 @@ void Servo::writeMicroseconds(int value)
   byte channel = this->servoIndex;
   if( (channel < MAX_SERVOS) )   // ensure channel is valid
   {
-    if (value < SERVO_MIN())          // ensure pulse width is valid
-      value = SERVO_MIN();
-    else if (value > SERVO_MAX())
-      value = SERVO_MAX();
-
-    value = value - TRIM_DURATION;
-    value = usToTicks(value);  // convert to ticks after compensating for interrupt overhead
-    servos[channel].ticks = value;
+    moves[channel].active = false;   // a direct write ends a background move
+    setTicks(channel, toTicks(value));
+  }
+}
+
+unsigned int Servo::toTicks(int value)
+{
+  if (value < SERVO_MIN())          // ensure pulse width is valid
+    value = SERVO_MIN();
+  else if (value > SERVO_MAX())
+    value = SERVO_MAX();
+
+  value = value - TRIM_DURATION;
+  return usToTicks(value);  // convert to ticks after compensating for interrupt overhead
+}
+
+void Servo::moveTo(int value, uint32_t duration, uint8_t profile)
+{
+  byte channel = this->servoIndex;
+  if (channel >= MAX_SERVOS)
+    return;
+
+  if (value < MIN_PULSE_WIDTH)   // angle in degrees as in write()
+    value = map(constrain(value, 0, 180), 0, 180, SERVO_MIN(), SERVO_MAX());
+
+  uint32_t frames = duration / (REFRESH_INTERVAL / 1000);
+  servoMove_t *m = &moves[channel];
+  m->active = false;   // the interrupt leaves the move alone until it is set up
+  __DMB();             // no store of the new move before this point
+  if (frames == 0 || !servos[channel].Pin.isActive) {
+    setTicks(channel, toTicks(value));
+    return;
   }
+  m->startTicks = LIVE_TICKS(channel);
+  m->targetTicks = toTicks(value);
+  m->delta = (int32_t) m->targetTicks - (int32_t) m->startTicks;
+  m->fraction = 0;
+  m->step = ((1UL << 24) + frames - 1) / frames;
+  m->profile = profile;
+  __DMB();             // the interrupt sees the complete move once it sees active
+  m->active = true;
+}
+
+void Servo::setScheduling(uint8_t mode)
+{
+  scheduleMode = mode;
+}
+
+void Servo::beginUpdate()
+{
+  holdSwap = true;   // from here on the interrupt does not swap, a committed group not applied yet is joined
+  if (syncedSwaps != swapCount) {
+    // the back buffer is the live buffer before the last swap: bring it up to date
+    for (uint8_t index = 0; index < MAX_SERVOS; index++) {
+      unsigned int ticks;
+      do {   // a move step in between writes both buffers: copy again, else the back buffer keeps the old value
+        ticks = LIVE_TICKS(index);
+        BACK_TICKS(index) = ticks;
+      } while (LIVE_TICKS(index) != ticks);
+    }
+    syncedSwaps = swapCount;
+  }
+  touched = false;
+  updating = true;
+}
+
+void Servo::commit()
+{
+  updating = false;
+  if (touched)
+    pending = true;   // swapped at the end of the next frame of swapTimer
+  holdSwap = false;
+  if (swapTimer < 0)
+    swapTicks();      // no interrupt running
+}
+
+bool Servo::moving()
+{
+  return (this->servoIndex < MAX_SERVOS) && moves[this->servoIndex].active;
+}
+
+void Servo::stopMove()
+{
+  if (this->servoIndex < MAX_SERVOS)
+    moves[this->servoIndex].active = false;
 }
 
 int Servo::read() // return the value as degrees
@@ -282,7 +749,7 @@ int Servo::readMicroseconds()
 {
   unsigned int pulsewidth;
   if (this->servoIndex != INVALID_SERVO)
-    pulsewidth = ticksToUs(servos[this->servoIndex].ticks)  + TRIM_DURATION;
+    pulsewidth = ticksToUs(LIVE_TICKS(this->servoIndex))  + TRIM_DURATION;
   else
     pulsewidth  = 0;
 
@@ -25,6 +25,9 @@
 
   Note that analogWrite of PWM on pins associated with the timer are
   disabled when the first servo is attached.
+  On SAMD, servos on PA06 and PA07 (pins 8 and 9 of the Arduino Zero) are
+  pulsed by TCC1 hardware PWM without any interrupt load; analogWrite on
+  these pins is not possible while such a servo is attached.
   Timers are seized as needed in groups of 12 servos - 24 servos use two
   timers, 48 servos will use four.
   The sequence used to seize timers is defined in timers.h
@@ -43,6 +46,11 @@
     readMicroseconds()   - Gets the last written servo pulse width in microseconds. (was read_us() in first release)
     attached()  - Returns true if there is a servo attached.
     detach()    - Stops an attached servos from pulsing its I/O pin.
+    moveTo(value, duration, profile) - Moves the servo in the background to an angle or pulse width within duration ms
+    moving()    - Returns true while a background move is running.
+    setScheduling(mode) - SCHEDULE_SEQUENTIAL pulses the servos one after another, SCHEDULE_SIMULTANEOUS starts all pulses together
+    beginUpdate() - Collects the following writes of all servos until commit(); joins a committed group that is not applied yet
+    commit()    - Applies the collected writes together at the next frame boundary
  */
 
 #ifndef ServoSAMD_h
@@ -75,18 +83,37 @@
 
 #define INVALID_SERVO         255     // flag indicating an invalid servo index
 
+#define MOVE_LINEAR             0     // constant speed
+#define MOVE_EASED              1     // smooth start and stop
+
+#define SCHEDULE_SEQUENTIAL     0     // pulses one after another, frame grows with the number of servos
+#define SCHEDULE_SIMULTANEOUS   1     // all pulses start at the frame start, end in order of pulse width
+
 #if !defined(ARDUINO_ARCH_STM32F4) && !defined(ARDUINO_ARCH_XMC)
 
 typedef struct  {
   uint8_t nbr        :6 ;             // a pin number from 0 to 63
   uint8_t isActive   :1 ;             // true if this channel is enabled, pin not pulsed if false
+  uint8_t isHardware :1 ;             // true if the pin is pulsed by TCC hardware PWM instead of the interrupt
 } ServoPin_t   ;
 
 typedef struct {
   ServoPin_t Pin;
-  volatile unsigned int ticks;
+  volatile unsigned int ticks[2];     // live and back buffer, see beginUpdate()
+  uint8_t port;                       // port group of the pin, set by attach()
+  uint32_t bitMask;                   // bit of the pin in its port group
 } servo_t;
 
+typedef struct {
+  volatile uint8_t active;            // stepped by the timer interrupt at the end of each refresh frame
+  uint8_t profile;                    // MOVE_LINEAR or MOVE_EASED
+  unsigned int startTicks;
+  unsigned int targetTicks;
+  int32_t delta;                      // targetTicks - startTicks
+  uint32_t fraction;                  // part of the move done, 1 << 24 = all
+  uint32_t step;                      // fraction per refresh frame, precomputed: no division in the interrupt
+} servoMove_t;
+
 class Servo
 {
 public:
@@ -99,7 +126,14 @@ public:
   int read();                        // returns current pulse width as an angle between 0 and 180 degrees
   int readMicroseconds();            // returns current pulse width in microseconds for this servo (was read_us() in first release)
   bool attached();                   // return true if this servo is attached, otherwise false
+  void moveTo(int value, uint32_t duration, uint8_t profile = MOVE_LINEAR); // move in the background within duration ms, value as in write()
+  bool moving();                     // return true while a background move is running
+  void stopMove();                   // stop a background move at the current position
+  static void setScheduling(uint8_t mode); // SCHEDULE_SEQUENTIAL (default) or SCHEDULE_SIMULTANEOUS, applied at the next frame
+  static void beginUpdate();         // collect the following writes of all servos, they join a committed group that is not applied yet
+  static void commit();              // apply the collected writes of all servos at one frame end, moving servos included
 private:
+   unsigned int toTicks(int value);  // limit pulse width in microseconds and convert it to ticks
    uint8_t servoIndex;               // index into the channel data for this servo
    int8_t min;                       // minimum is this value times 4 added to MIN_PULSE_WIDTH
    int8_t max;                       // maximum is this value times 4 added to MAX_PULSE_WIDTH
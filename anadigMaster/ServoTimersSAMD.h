@@ -34,8 +34,8 @@
 
 // For SAMD:
 #define _useTimer1
-//#define _useTimer2   // <- TODO do not activate until the code in Servo.cpp has been changed in order
-                       //         to manage more than one channel per timer on the SAMD architecture
+#define _useTimer2     // second compare channel of the same TC as timer 1, served by the same handler
+//#define _useTimer3   // TC3: 12 more servos, TC3 must not be used by other libraries (tone() uses TC5)
 
 #if defined (_useTimer1)
 #define TC_FOR_TIMER1             TC4
@@ -53,11 +53,23 @@
 #define CHANNEL_FOR_TIMER2        1
 #define INTENSET_BIT_FOR_TIMER_2  TC_INTENSET_MC1
 #define INTENCLR_BIT_FOR_TIMER_2  TC_INTENCLR_MC1
+#define INTFLAG_BIT_FOR_TIMER_2   TC_INTFLAG_MC1
 #define ID_TC_FOR_TIMER2          ID_TC4
 #define IRQn_FOR_TIMER2           TC4_IRQn
 #define HANDLER_FOR_TIMER2        TC4_Handler
 #define GCM_FOR_TIMER_2           GCM_TC4_TC5
 #endif
+#if defined (_useTimer3)
+#define TC_FOR_TIMER3             TC3
+#define CHANNEL_FOR_TIMER3        0
+#define INTENSET_BIT_FOR_TIMER_3  TC_INTENSET_MC0
+#define INTENCLR_BIT_FOR_TIMER_3  TC_INTENCLR_MC0
+#define INTFLAG_BIT_FOR_TIMER_3   TC_INTFLAG_MC0
+#define ID_TC_FOR_TIMER3          ID_TC3
+#define IRQn_FOR_TIMER3           TC3_IRQn
+#define HANDLER_FOR_TIMER3        TC3_Handler
+#define GCM_FOR_TIMER_3           GCM_TCC2_TC3
+#endif
 
 typedef enum {
 #if defined (_useTimer1)
@@ -65,6 +77,9 @@ typedef enum {
 #endif
 #if defined (_useTimer2)
     _timer2,
+#endif
+#if defined (_useTimer3)
+    _timer3,
 #endif
     _Nbr_16timers } timer16_Sequence_t;
 
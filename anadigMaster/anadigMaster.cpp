@@ -1,5 +1,52 @@
 #include "anadigMaster.h"
 
+TaskLoop::TaskLoop() {  // constructor
+  taskCount = 0;
+  lastRun = 0;
+  latency = 0;
+}
+
+bool TaskLoop::add(void (*task)(), uint16_t period) {
+  if (taskCount >= MAX_TASKS) return false;
+  tasks[taskCount].function = task;
+  tasks[taskCount].period = period;
+  tasks[taskCount].due = millis();
+  taskCount++;
+  return true;
+}
+
+void TaskLoop::remove(void (*task)()) {
+  for (uint8_t i = 0; i < taskCount; i++) {
+    if (tasks[i].function == task) {
+      taskCount--;
+      for (uint8_t j = i; j < taskCount; j++) tasks[j] = tasks[j+1];
+      return;
+    }
+  }
+}
+
+void TaskLoop::run() {
+  uint32_t now = micros();
+  if (lastRun != 0 && now - lastRun > latency) latency = now - lastRun;
+  lastRun = now;
+  for (uint8_t i = 0; i < taskCount; i++) {
+    if ((int32_t)(millis() - tasks[i].due) >= 0) {
+      tasks[i].function();
+      tasks[i].due += tasks[i].period;
+      if ((int32_t)(millis() - tasks[i].due) > (int32_t)tasks[i].period) tasks[i].due = millis();  // too late: skip missed calls
+    }
+  }
+}
+
+uint32_t TaskLoop::maxLatency() {
+  return latency;
+}
+
+void TaskLoop::resetStats() {
+  lastRun = 0;
+  latency = 0;
+}
+
 #define BatteryVoltagePin A0
 float Battery::getVoltage() {
   uint16_t adcValue;
@@ -29,6 +76,16 @@ void Button::wait(uint32_t dly = 0) {  // millisecs
 }
 void Button::wait() {wait(0);}
 
+bool Button::clicked() {
+  bool state = pressed();
+  if (state != lastState && millis() - lastChange >= 5) {  // debouncing of button contact
+    lastState = state;
+    lastChange = millis();
+    return !state;  // released
+  }
+  return false;
+}
+
 uint16_t Button::count(uint8_t timeout = 2) {  // seconds
   uint16_t counts = 0;
   unsigned long timer = millis();
@@ -66,6 +123,23 @@ void Led::blink(uint8_t count, uint16_t period) {  // period in ms
   }
 }
 
+void Led::startBlink(uint8_t count, uint16_t period) {  // period in ms
+  toggles = 2 * count;
+  halfPeriod = period/2;
+  nextToggle = millis();
+}
+
+bool Led::update() {
+  if (toggles == 0) return false;
+  if ((int32_t)(millis() - nextToggle) >= 0) {
+    if (toggles % 2 == 0) on();
+    else off();
+    toggles--;
+    nextToggle += halfPeriod;
+  }
+  return (toggles > 0);
+}
+
 LineSensor::LineSensor() {  // constructor
   pinMode(LedPin, OUTPUT);
   pinMode(LedPinInv, OUTPUT);
@@ -95,6 +169,11 @@ void LineSensor::getAmbient(int16_t &aL, int16_t &aR) {
 }
 
 void LineSensor::getReflections(int16_t &aL, int16_t &aR) {  // takes 2.5 millisec
+  if (sampling) {  // latest pair of background sampling
+    aL = reflectionL;
+    aR = reflectionR;
+    return;
+  }
   int32_t a1 = 0, a2 = 0;
   ledOn();
   for (int i = 0; i < averaging; i++) {
@@ -161,6 +240,202 @@ int16_t LineSensor::getOffset() {
   return (int16_t)diff;
 }
 
+void LineSensor::startSampling(uint8_t oversampling, uint16_t settleOn, uint16_t settleOff) {
+  int16_t a1, a2;
+  samples = max(oversampling, 1);
+  settleOnUs = settleOn;
+  settleOffUs = settleOff;
+  sampling = false;
+  lockIn = false;
+  getReflections(a1, a2);  // first pair
+  reflectionL = a1;
+  reflectionR = a2;
+  reflectionTime = micros();
+  sampling = true;
+  ledOn();
+  phase = 0;
+  phaseStart = micros();
+}
+
+void LineSensor::startSampling() {
+  startSampling(5, 250, 1000);
+}
+
+void LineSensor::startLockIn(uint16_t carrier, uint16_t window) {
+  startSampling(1, 0, 0);  // first pair
+  halfPeriodUs = 500000UL / max(carrier, 1);
+  windowUs = (uint32_t)window * 1000 / (2 * halfPeriodUs) * (2 * halfPeriodUs);  // whole carrier periods
+  windowUs = max(windowUs, 2UL * halfPeriodUs);
+  sumL = 0; sumR = 0; offL = 0; offR = 0;
+  countOn = 0; countOff = 0;
+  windowStart = micros();
+  lockIn = true;
+}
+
+void LineSensor::startLockIn() {
+  startLockIn(500, 10);
+}
+
+void LineSensor::stopSampling() {
+  sampling = false;
+  lockIn = false;
+  ledOff();
+}
+
+void LineSensor::readSensors(int32_t &a1, int32_t &a2, uint8_t count) {
+  a1 = 0; a2 = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    a1 += analogReadFast(LSensorPin);
+    a2 += analogReadFast(RSensorPin);
+  }
+}
+
+bool LineSensor::update() {
+  int32_t a1, a2;
+  if (!sampling) return false;
+  if (lockIn) return lockInStep();
+  if (phase == 0) {
+    if (micros() - phaseStart < settleOnUs) return false;
+    readSensors(sumL, sumR, samples);
+    ledOff();
+    phase = 1;
+    phaseStart = micros();
+    return false;
+  }
+  if (micros() - phaseStart < settleOffUs) return false;
+  readSensors(a1, a2, samples);
+  ledOn();
+  phase = 0;
+  phaseStart = micros();
+  reflectionL = constrain((sumL - a1) / samples, 1, 1023);
+  reflectionR = constrain((sumR - a2) / samples, 1, 1023);
+  reflectionTime = phaseStart;
+  return true;
+}
+
+bool LineSensor::lockInStep() {
+  // LED follows the carrier; every sample is added to the LED on or off sums, so slow
+  // ambient changes cancel out, and the window spans whole periods of 50/100 Hz flicker
+  int32_t a1, a2;
+  uint32_t t = micros() - windowStart;
+  uint8_t ledState = (t / halfPeriodUs) % 2;  // 0 = LED on, 1 = LED off
+  if (ledState != phase) {
+    if (ledState == 0) ledOn();
+    else ledOff();
+    phase = ledState;
+  }
+  else if (t % halfPeriodUs >= halfPeriodUs / 2) {  // second half of the LED phase: sensor settled
+    readSensors(a1, a2, 1);
+    if (phase == 0) {
+      sumL += a1; sumR += a2; countOn++;
+    }
+    else {
+      offL += a1; offR += a2; countOff++;
+    }
+  }
+  if (t < windowUs) return false;
+  windowStart += windowUs;
+  if (t >= 2 * windowUs) windowStart = micros();  // loop too slow: restart window
+  bool ready = (countOn > 0 && countOff > 0);
+  if (ready) {
+    reflectionL = constrain(sumL / countOn - offL / countOff, 1, 1023);
+    reflectionR = constrain(sumR / countOn - offR / countOff, 1, 1023);
+    reflectionTime = micros();
+  }
+  sumL = 0; sumR = 0; offL = 0; offR = 0;
+  countOn = 0; countOff = 0;
+  return ready;
+}
+
+uint32_t LineSensor::sampleTime() {
+  return reflectionTime;
+}
+
+LineFollower::LineFollower(LineSensor &_sensor, void (*_steer)(int16_t)) : sensor(_sensor) {  // constructor
+  steer = _steer;
+  resetStats();
+}
+
+void LineFollower::setGains(int16_t kp, int16_t ki, int16_t kd) {
+  kP = kp;
+  kI = ki;
+  kD = kd;
+  integral = 0;
+}
+
+void LineFollower::setFeedForward(int16_t steering) {
+  feedForward = steering;
+}
+
+void LineFollower::setDeadband(uint8_t deadband) {
+  deadbandSteps = deadband;
+}
+
+void LineFollower::start(uint16_t period) {
+  periodUs = 1000UL * max(period, 1);
+  nextCycle = micros();
+  integral = 0;
+  lastError = sensor.getOffset();
+  lastSteering = 0;
+  running = true;
+  resetStats();
+}
+
+void LineFollower::start() {
+  start(10);
+}
+
+void LineFollower::stop() {
+  running = false;
+  lastSteering = 0;
+  steer(0);
+}
+
+bool LineFollower::update() {
+  // fixed rate: the offset uses the latest background pair if the line sensor is sampling
+  int32_t late, output;
+  int16_t error;
+  if (!running) return false;
+  late = (int32_t)(micros() - nextCycle);
+  if (late < 0) return false;
+  jitterMax = max(jitterMax, (uint32_t)late);
+  jitterSum += late;
+  cycles++;
+  nextCycle += periodUs;
+  if (late > (int32_t)periodUs) nextCycle = micros() + periodUs;  // too late: skip missed cycles
+  error = sensor.getOffset();  // -1000 ... +1000
+  if (kI != 0) {  // anti windup: integral part limited to full steering
+    integral += error;
+    integral = constrain(integral, -100000L / abs(kI), 100000L / abs(kI));
+  }
+  output = ((int32_t)kP * error + (int32_t)kI * integral + (int32_t)kD * (error - lastError)) / 1000 + feedForward;
+  output = constrain(output, -100, 100);
+  lastError = error;
+  if (abs(output - lastSteering) >= deadbandSteps || (output == 0 && lastSteering != 0)) {
+    lastSteering = output;
+    steer(lastSteering);
+  }
+  return true;
+}
+
+int16_t LineFollower::steering() {
+  return lastSteering;
+}
+
+uint32_t LineFollower::maxJitter() {
+  return jitterMax;
+}
+
+uint32_t LineFollower::meanJitter() {
+  return (cycles > 0) ? jitterSum / cycles : 0;
+}
+
+void LineFollower::resetStats() {
+  jitterMax = 0;
+  jitterSum = 0;
+  cycles = 0;
+}
+
 UltrasonicSensor::UltrasonicSensor() {  // constructor
   pinMode(triggerPin1, OUTPUT);
   pinMode(triggerPin2, OUTPUT);
@@ -172,30 +447,114 @@ UltrasonicSensor::UltrasonicSensor() {  // constructor
 
 int16_t UltrasonicSensor::measureDistance(uint8_t triggerPin, uint8_t echoPin) {
   uint32_t duration;  // us
-  uint32_t distance;  // mm
   digitalWrite(triggerPin, HIGH);
   delayMicroseconds(10);
   digitalWrite(triggerPin, LOW); // start transmitting
   duration = pulseIn(echoPin, HIGH, 38000);  // max 38 ms
+  return toDistance(duration);
+}
+
+int16_t UltrasonicSensor::toDistance(uint32_t duration) {  // us
+  uint32_t distance;  // mm
   distance = duration * ultrasoundSpeed / 2000; 
   if (distance > 2000) distance = 0;
   return (int16_t)distance;
 }
 
 int16_t UltrasonicSensor::getDistance() {
-  return measureDistance(triggerPin1, echoPin1);
+  return getDistance1();
 }
 
 int16_t UltrasonicSensor::getDistance1() {
+  if (rangingSensors & 1) return distance[0];
   return measureDistance(triggerPin1, echoPin1);
 }
 
 int16_t UltrasonicSensor::getDistance2() {
+  if (rangingSensors & 2) return distance[1];
   return measureDistance(triggerPin2, echoPin2);
 }
 
+UltrasonicSensor *UltrasonicSensor::rangingSensor = NULL;
+
+void UltrasonicSensor::echo1ISR() {
+  rangingSensor->echoEdge(0, rangingSensor->echoPin1);
+}
+
+void UltrasonicSensor::echo2ISR() {
+  rangingSensor->echoEdge(1, rangingSensor->echoPin2);
+}
+
+void UltrasonicSensor::echoEdge(uint8_t sensor, uint8_t echoPin) {
+  if (digitalRead(echoPin)) echoStart[sensor] = micros();  // rising edge: sound sent
+  else if (echoStart[sensor] != 0) {  // falling edge: echo received
+    echoDuration[sensor] = micros() - echoStart[sensor];
+    echoDone[sensor] = true;
+  }
+}
+
+void UltrasonicSensor::startRanging(uint8_t sensors, uint16_t interval) {
+  rangingSensors = sensors & 3;
+  rangingInterval = interval;
+  measuring = false;
+  current = (rangingSensors == 2) ? 1 : 0;
+  rangingSensor = this;
+  if (rangingSensors & 1) attachInterrupt(digitalPinToInterrupt(echoPin1), echo1ISR, CHANGE);
+  if (rangingSensors & 2) attachInterrupt(digitalPinToInterrupt(echoPin2), echo2ISR, CHANGE);
+  triggerTime = millis() - interval;
+}
+
+void UltrasonicSensor::stopRanging() {
+  if (rangingSensors & 1) detachInterrupt(digitalPinToInterrupt(echoPin1));
+  if (rangingSensors & 2) detachInterrupt(digitalPinToInterrupt(echoPin2));
+  rangingSensors = 0;
+  measuring = false;
+}
+
+void UltrasonicSensor::update() {
+  if (rangingSensors == 0) return;
+  if (measuring) {
+    if (echoDone[current]) finishMeasurement(toDistance(echoDuration[current]));
+    else if (millis() - triggerTime > 40) finishMeasurement(0);  // no echo within 38 ms
+    else return;
+  }
+  if (millis() - triggerTime < rangingInterval) return;
+  if (rangingSensors == 3) current = 1 - current;  // fire sensors alternately to avoid crosstalk
+  echoStart[current] = 0;
+  echoDone[current] = false;
+  uint8_t triggerPin = (current == 0) ? triggerPin1 : triggerPin2;
+  digitalWrite(triggerPin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(triggerPin, LOW); // start transmitting
+  triggerTime = millis();
+  measuring = true;
+}
+
+void UltrasonicSensor::finishMeasurement(int16_t _distance) {
+  distance[current] = _distance;
+  sampleTime[current] = triggerTime;
+  measuring = false;
+}
+
+int16_t UltrasonicSensor::lastDistance1() {
+  return distance[0];
+}
+
+int16_t UltrasonicSensor::lastDistance2() {
+  return distance[1];
+}
+
+uint32_t UltrasonicSensor::sampleTime1() {
+  return sampleTime[0];
+}
+
+uint32_t UltrasonicSensor::sampleTime2() {
+  return sampleTime[1];
+}
+
 ServoMotor::ServoMotor(byte _type, byte _servoPin) {  // constructor
   lastAngle = 0;
+  targetAngle = 0;
   servoPin = _servoPin;
   switch (_type) {
     case MINI:
@@ -220,25 +579,31 @@ void ServoMotor::turnTo(int16_t angle) {
   attach(servoPin);
   writeMicroseconds(angle2pulsewidth(angle));
   lastAngle = angle;
+  targetAngle = angle;
 }
 
 void ServoMotor::slowTo(int16_t angle, uint16_t speed) {  // speed in degrees/sec
+  startSlowTo(angle, speed);
+  while (moving()) delay(1);
+}
+
+void ServoMotor::startSlowTo(int16_t angle, uint16_t speed) {  // speed in degrees/sec
   int16_t _angle = constrain(angle, 0, maxAngle);
-  uint16_t dly = 1000 / speed;
+  glideTo(_angle, (uint32_t)abs(_angle - lastAngle) * 1000 / (speed ? speed : 1), false);
+}
+
+void ServoMotor::glideTo(int16_t angle, uint32_t duration, bool eased) {
+  // the servo timer interrupt interpolates the pulse width once per 20 ms frame
+  bool wasAttached = attached();
   attach(servoPin);
-  if (angle > lastAngle) {
-    for (int16_t a = lastAngle; a <= angle; a ++) {
-      writeMicroseconds(angle2pulsewidth(a));
-      delay(dly);
-    }
-  }
-  else if (angle < lastAngle) {
-    for (int16_t a = lastAngle; a >= angle; a --) {
-      writeMicroseconds(angle2pulsewidth(a));
-      delay(dly);
-    }
-  }
-  lastAngle = angle;
+  if (!wasAttached) writeMicroseconds(angle2pulsewidth(lastAngle));  // start from the last known position
+  targetAngle = constrain(angle, 0, maxAngle);
+  moveTo(angle2pulsewidth(targetAngle), duration, eased ? MOVE_EASED : MOVE_LINEAR);
+  lastAngle = targetAngle;
+}
+
+bool ServoMotor::update() {
+  return moving();
 }
 
 void ServoMotor::coast() {
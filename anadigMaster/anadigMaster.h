@@ -8,6 +8,49 @@
 #include "ServoSAMD.h"
 #include "avdweb_AnalogReadFast.h"
 
+const uint8_t MAX_TASKS = 8;  // max. number of functions in a TaskLoop
+
+class TaskLoop {
+public:
+  TaskLoop();
+
+/**
+ * @brief Add function to be called every period milliseconds (0 = at every run)
+ */
+  bool add(void (*task)(), uint16_t period);
+
+/**
+ * @brief Remove function from the loop
+ */
+  void remove(void (*task)());
+
+/**
+ * @brief Call all functions which are due - call it in loop() without any delay
+ */
+  void run();
+
+/**
+ * @brief Get longest time between two runs in microseconds
+ */
+  uint32_t maxLatency();
+
+/**
+ * @brief Reset latency statistics
+ */
+  void resetStats();
+
+private:
+  struct Task {
+    void (*function)();
+    uint16_t period;
+    uint32_t due;  // millis() of next call
+  };
+  Task tasks[MAX_TASKS];
+  uint8_t taskCount;
+  uint32_t lastRun;  // micros() of last run
+  uint32_t latency;
+};
+
 
 class Battery {
 public:
@@ -38,6 +81,11 @@ public:
   void wait(uint32_t dly);
   void wait();  // default dly 0
 
+/**
+ * @brief Return TRUE once when button was pressed and released - does not wait
+ */
+  bool clicked();
+
 /**
  * @brief Count button ticks with timeout in seconds
  */
@@ -46,6 +94,8 @@ public:
   
 private:
   const byte ButtonPin = 7;
+  bool lastState = false;
+  uint32_t lastChange = 0;
 };
 
 class Led {
@@ -67,8 +117,21 @@ public:
  */
   void blink(uint8_t count, uint16_t period);
 
+/**
+ * @brief Start blinking count times for period milliseconds - does not wait
+ */
+  void startBlink(uint8_t count, uint16_t period);
+
+/**
+ * @brief Continue blinking - returns false when done; call it in loop()
+ */
+  bool update();
+
 private:
   const byte LedPin = 6;
+  uint8_t toggles = 0;
+  uint16_t halfPeriod;
+  uint32_t nextToggle;
 };
 
 class LineSensor {
@@ -125,12 +188,56 @@ void calibrate(int16_t _whiteL, int16_t _whiteR, int16_t _blackL, int16_t _black
  */
 int16_t getOffset();
 
+/**
+ * @brief Start background sampling with oversampling pairs per LED phase and settling times in us
+ */
+void startSampling(uint8_t oversampling, uint16_t settleOn, uint16_t settleOff);
+void startSampling();  // default 5 pairs, 250 us, 1000 us
+
+/**
+ * @brief Start background lock-in sampling: LED modulated with carrier Hz, result every window ms
+ */
+void startLockIn(uint16_t carrier, uint16_t window);
+void startLockIn();  // default 500 Hz, 10 ms (rejects 50/100 Hz flicker)
+
+/**
+ * @brief Stop background sampling; measurements are blocking again
+ */
+void stopSampling();
+
+/**
+ * @brief Continue background sampling - returns true if a new reflection pair is ready; call it in loop()
+ */
+bool update();
+
+/**
+ * @brief Get time stamp (micros) of the latest reflection pair
+ */
+uint32_t sampleTime();
+
 private:
+  void readSensors(int32_t &a1, int32_t &a2, uint8_t count);
   const byte LedPin = 2;
   const byte LedPinInv = 3;
   const byte LSensorPin = A3;
   const byte RSensorPin = A4;
   const byte averaging = 5;
+  bool lockInStep();
+  bool sampling = false;
+  bool lockIn = false;
+  uint8_t samples;      // pairs per LED phase
+  uint16_t settleOnUs;  // wait after LED on
+  uint16_t settleOffUs; // wait after LED off
+  uint8_t phase;        // 0 = LED on, 1 = LED off
+  uint32_t phaseStart;  // micros()
+  int32_t sumL, sumR;   // LED on minus LED off
+  uint32_t halfPeriodUs;  // lock-in: half carrier period
+  uint32_t windowUs;      // lock-in: integration window, whole carrier periods
+  uint32_t windowStart;   // micros()
+  int32_t offL, offR;     // lock-in: sums of LED off samples
+  uint16_t countOn, countOff;
+  int16_t reflectionL, reflectionR;  // latest pair
+  uint32_t reflectionTime;
   int16_t whiteL;
   int16_t whiteR;
   int16_t blackL;
@@ -138,21 +245,132 @@ private:
   int32_t lastOffset;
 };
 
+class LineFollower {
+public:
+  LineFollower(LineSensor &_sensor, void (*_steer)(int16_t));  // _steer e.g. calls Drivetrain::setSteering()
+
+/**
+ * @brief Set PID gains in 1/1000 steering per offset unit (default 100, 0, 200)
+ */
+  void setGains(int16_t kp, int16_t ki, int16_t kd);
+
+/**
+ * @brief Set steering added to the controller output, e.g. for a known curve
+ */
+  void setFeedForward(int16_t steering);
+
+/**
+ * @brief Set minimum steering change to be sent (default 2)
+ */
+  void setDeadband(uint8_t deadband);
+
+/**
+ * @brief Start following the line with a control cycle every period ms
+ */
+  void start(uint16_t period);
+  void start();  // default 10 ms
+
+/**
+ * @brief Stop following the line and send steering 0
+ */
+  void stop();
+
+/**
+ * @brief Run the control cycle when due - returns true if it ran; call it in loop() without any delay
+ */
+  bool update();
+
+/**
+ * @brief Get last steering value sent
+ */
+  int16_t steering();
+
+/**
+ * @brief Get longest and mean delay of the control cycles in microseconds
+ */
+  uint32_t maxJitter();
+  uint32_t meanJitter();
+
+/**
+ * @brief Reset jitter statistics
+ */
+  void resetStats();
+
+private:
+  LineSensor &sensor;
+  void (*steer)(int16_t);
+  int16_t kP = 100, kI = 0, kD = 200;
+  int16_t feedForward = 0;
+  uint8_t deadbandSteps = 2;
+  bool running = false;
+  uint32_t periodUs;
+  uint32_t nextCycle;   // micros()
+  int32_t integral;
+  int16_t lastError;
+  int16_t lastSteering;
+  uint32_t jitterMax;
+  uint32_t jitterSum;
+  uint32_t cycles;
+};
+
 class UltrasonicSensor {
 public:
   UltrasonicSensor();
   
 /**
- * @brief Measure distance in mm, 0 = not valid
+ * @brief Measure distance in mm, 0 = not valid; returns last ranging result while ranging
  */
   int16_t getDistance();
   int16_t getDistance1();
   int16_t getDistance2();
 
+/**
+ * @brief Start interrupt driven ranging of sensor 1, 2 or both (3) alternately every interval ms
+ */
+  void startRanging(uint8_t sensors, uint16_t interval);
+
+/**
+ * @brief Stop interrupt driven ranging
+ */
+  void stopRanging();
+
+/**
+ * @brief Trigger the next measurement when due - call it in loop()
+ */
+  void update();
+
+/**
+ * @brief Get last ranging result in mm without waiting, 0 = not valid
+ */
+  int16_t lastDistance1();
+  int16_t lastDistance2();
+
+/**
+ * @brief Get time stamp (millis) of last ranging result
+ */
+  uint32_t sampleTime1();
+  uint32_t sampleTime2();
+
   uint16_t ultrasoundSpeed = 343;  // m/s
   
 private:
   int16_t measureDistance(uint8_t triggerPin, uint8_t echoPin);
+  int16_t toDistance(uint32_t duration);
+  void finishMeasurement(int16_t distance);
+  static void echo1ISR();
+  static void echo2ISR();
+  static UltrasonicSensor *rangingSensor;  // instance served by the interrupts
+  void echoEdge(uint8_t sensor, uint8_t echoPin);
+  volatile uint32_t echoStart[2];  // micros() of rising edge
+  volatile uint32_t echoDuration[2];
+  volatile bool echoDone[2];
+  int16_t distance[2] = {0, 0};
+  uint32_t sampleTime[2] = {0, 0};
+  uint8_t rangingSensors = 0;  // bit 0 = sensor 1, bit 1 = sensor 2
+  uint8_t current = 0;  // sensor of running measurement
+  bool measuring = false;
+  uint16_t rangingInterval;
+  uint32_t triggerTime;  // millis() of last trigger
   const byte triggerPin1 = 4;
   const byte echoPin1 = 5;
   const byte triggerPin2 = 15;
@@ -176,6 +394,21 @@ public:
  */
   void slowTo(int16_t angle, uint16_t speed);
   
+/**
+ * @brief Start turning servo to degrees (absolutely) slowly with speed degrees/s - does not wait
+ */
+  void startSlowTo(int16_t angle, uint16_t speed);
+  
+/**
+ * @brief Start turning servo to degrees (absolutely) within duration ms, eased = smooth start and stop - does not wait
+ */
+  void glideTo(int16_t angle, uint32_t duration, bool eased = true);
+  
+/**
+ * @brief Get information if the servo is still turning - returns false when target is reached
+ */
+  bool update();
+  
 /**
  * @brief Let servo coast - turn current off
  */
@@ -184,6 +417,7 @@ public:
 private:
   int16_t angle2pulsewidth(int16_t angle);
   int16_t lastAngle;
+  int16_t targetAngle;
   byte servoPin;  // 8 or 9
   int16_t maxAngle;
   uint16_t pw_min;
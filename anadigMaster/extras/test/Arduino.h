@@ -0,0 +1,173 @@
+/*
+  Host model of the Arduino core and the SAMD21 registers used by ServoSAMD.cpp
+
+  TC COUNT advances one tick per read (the CPU time of the interrupt), a compare
+  match sets its INTFLAG bit, and the pin writes to PORT OUTSET/OUTCLR are logged
+  with the tick they happen at. See servo_test.cpp.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define OUTPUT 1
+#define clockCyclesPerMicrosecond() (48)
+
+template<class T, class L> auto min(const T& a, const L& b) -> decltype((b < a) ? b : a) { return (b < a) ? b : a; }
+template<class T, class L> auto max(const T& a, const L& b) -> decltype((b < a) ? b : a) { return (a < b) ? b : a; }
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+inline void pinMode(uint32_t, uint32_t) {}
+inline void noInterrupts() {}
+inline void interrupts() {}
+#define __DMB() __asm__ volatile("" ::: "memory")
+
+// ---- simulated time: TC ticks of GCLK/16 (3 per us) ----
+
+extern uint32_t simNow;
+void simTick();                          // one tick: counter and compare matches
+
+// ---- registers ----
+
+struct CountReg {                        // COUNT: reading takes a tick
+  operator uint16_t() const { simTick(); return (uint16_t) simNow; }
+};
+
+struct FlagReg {                         // INTFLAG: write 1 to clear
+  volatile uint8_t value;
+  FlagReg &operator=(uint8_t v) { value &= ~v; return *this; }
+  operator uint8_t() const { return value; }
+};
+
+struct EnableReg {                       // INTENSET / INTENCLR share one enable mask
+  uint8_t *mask;
+  bool set;
+  EnableReg &operator=(uint8_t v) { if (set) *mask |= v; else *mask &= ~v; return *this; }
+  operator uint8_t() const { return *mask; }
+};
+
+struct TcCtrlaBits {
+  uint16_t :1, ENABLE:1, MODE:2, :1, WAVEGEN:2, :1, PRESCALER:3, :5;
+  static const uint16_t SWRST = 0;       // the reset is done at once
+};
+
+struct SyncBits {
+  uint8_t :7;
+  static const uint8_t SYNCBUSY = 0;     // registers are written at once
+};
+
+typedef struct {
+  union { TcCtrlaBits bit; uint16_t reg; } CTRLA;
+  union { uint16_t reg; } READREQ;
+  union { struct { uint8_t DIR:1, :7; } bit; uint8_t reg; } CTRLBCLR, CTRLBSET;
+  union { SyncBits bit; uint8_t reg; } STATUS;
+  struct { FlagReg reg; } INTFLAG;
+  struct { EnableReg reg; } INTENSET, INTENCLR;
+  struct { CountReg reg; } COUNT;
+  struct { uint16_t reg; } CC[2];
+  uint8_t intEnable;
+} TcCount16;
+
+struct Tc { TcCount16 COUNT16; };
+
+struct TccCtrlaBits {
+  uint32_t :1, ENABLE:1, :6, PRESCALER:3, :21;
+  static const uint32_t SWRST = 0;
+};
+
+typedef struct {
+  union { TccCtrlaBits bit; uint32_t reg; } CTRLA;
+  struct { uint8_t reg; } CTRLBSET, CTRLBCLR;
+  struct { uint32_t reg; } SYNCBUSY, WAVE, PER, CC[4], CCB[4], INTENSET, INTENCLR, INTFLAG;
+} Tcc;
+
+struct PinLevelReg {                     // OUTSET / OUTCLR: logged
+  uint8_t group;
+  bool high;
+  PinLevelReg &operator=(uint32_t mask);
+};
+
+typedef struct {
+  struct { PinLevelReg reg; } OUTSET, OUTCLR;
+  struct { uint8_t reg; } PINCFG[32], PMUX[16];
+} PortGroup;
+
+typedef struct { PortGroup Group[2]; } Port;
+
+typedef struct {
+  struct { uint16_t reg; } CLKCTRL;
+  union { SyncBits bit; uint8_t reg; } STATUS;
+} Gclk;
+
+extern Tc *TC3, *TC4, *TC5;
+extern Tcc *TCC1;
+extern Port *PORT;
+extern Gclk *GCLK;
+
+typedef enum { TC3_IRQn, TC4_IRQn, TC5_IRQn, TCC1_IRQn } IRQn_Type;
+inline void NVIC_DisableIRQ(IRQn_Type) {}
+inline void NVIC_EnableIRQ(IRQn_Type) {}
+inline void NVIC_ClearPendingIRQ(IRQn_Type) {}
+inline void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+
+typedef enum { PORTA, PORTB } EPortType;
+typedef struct { EPortType ulPort; uint32_t ulPin; } PinDescription;
+extern const PinDescription g_APinDescription[];
+
+#define TC_CTRLA_SWRST             0x0001
+#define TC_CTRLA_ENABLE            0x0002
+#define TC_CTRLA_MODE_COUNT16      0x0000
+#define TC_CTRLA_MODE_COUNT8       0x0004
+#define TC_CTRLA_MODE_Msk          0x000C
+#define TC_CTRLA_WAVEGEN_NPWM      0x0040
+#define TC_CTRLA_WAVEGEN_Msk       0x0060
+#define TC_CTRLA_PRESCALER_DIV16   0x0400
+#define TC_CTRLA_PRESCALER_DIV256  0x0600
+#define TC_CTRLA_PRESCALER_Msk     0x0700
+#define TC_READREQ_ADDR(x)         ((x) & 0x1F)
+#define TC_READREQ_RCONT           0x4000
+#define TC_READREQ_RREQ            0x8000
+#define TC_COUNT16_COUNT_OFFSET    0x10
+#define TC_INTFLAG_MC0             0x10
+#define TC_INTFLAG_MC1             0x20
+#define TC_INTENSET_MC0            0x10
+#define TC_INTENSET_MC1            0x20
+#define TC_INTENCLR_MC0            0x10
+#define TC_INTENCLR_MC1            0x20
+
+#define TCC_CTRLA_SWRST            0x0001
+#define TCC_CTRLA_ENABLE           0x0002
+#define TCC_CTRLA_PRESCALER_DIV16  0x0400
+#define TCC_CTRLA_PRESCALER_Msk    0x0700
+#define TCC_WAVE_WAVEGEN_NPWM      0x2
+#define TCC_WAVE_WAVEGEN_Msk       0x7
+#define TCC_INTENSET_OVF           0x1
+#define TCC_INTFLAG_OVF            0x1
+#define TCC_CTRLBSET_LUPD          0x2
+#define TCC_CTRLBCLR_LUPD          0x2
+#define TCC_SYNCBUSY_MASK          0xFFF
+
+#define ID_TC3                     27
+#define ID_TC4                     28
+#define GCM_TCC2_TC3               0x1B
+#define GCM_TC4_TC5                0x1C
+#define GCM_TCC0_TCC1              0x1A
+#define GCLK_CLKCTRL_CLKEN         0x4000
+#define GCLK_CLKCTRL_GEN_GCLK0     0x0000
+#define GCLK_CLKCTRL_ID(x)         (x)
+#define PORT_PINCFG_PMUXEN         0x01
+#define PORT_PMUX_PMUXE_E          0x04
+#define PORT_PMUX_PMUXO_E          0x40
+
+#endif
@@ -0,0 +1,423 @@
+/*
+  Host test of the servo interrupt engine in ServoSAMD.cpp
+
+  The library source is compiled against the register model in Arduino.h: TC4 counts
+  in simulated ticks, compare matches raise INTFLAG and TC4_Handler() is called like
+  the NVIC would, optionally late by a random latency. The pin writes are logged, so
+  pulse widths, frame periods and the frame a group update takes effect in can be
+  checked. Build and run with make in this directory.
+*/
+
+#include "../../ServoSAMD.cpp"
+
+#include <stdio.h>
+#include <vector>
+
+uint32_t simNow;
+static Tc tc3, tc4, tc5;
+static Tcc tcc1;
+static Port port;
+static Gclk gclk;
+Tc *TC3 = &tc3, *TC4 = &tc4, *TC5 = &tc5;
+Tcc *TCC1 = &tcc1;
+Port *PORT = &port;
+Gclk *GCLK = &gclk;
+
+const PinDescription g_APinDescription[] = {   // Arduino Zero pins 0 ... 13, then free port bits
+  {PORTA, 11}, {PORTA, 10}, {PORTA, 14}, {PORTA,  9}, {PORTA,  8}, {PORTA, 15}, {PORTA, 20}, {PORTA, 21},
+  {PORTA,  6}, {PORTA,  7}, {PORTA, 18}, {PORTA, 16}, {PORTA, 19}, {PORTA, 17}, {PORTA,  2}, {PORTB,  8},
+  {PORTB,  9}, {PORTA,  4}, {PORTA,  5}, {PORTB,  2}, {PORTA, 22}, {PORTA, 23}, {PORTA, 12}, {PORTB, 10},
+  {PORTB, 11}, {PORTB,  3}, {PORTA, 27}, {PORTA, 28}, {PORTA, 24}, {PORTA, 25}, {PORTB, 22}, {PORTB, 23}
+};
+
+static const int servoPins[24] = {   // all but 8 and 9, which are driven by TCC1
+  0, 1, 2, 3, 4, 5, 6, 7, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25
+};
+
+#define FRAME_TICKS  usToTicks(REFRESH_INTERVAL)
+
+// ---- register model ----
+
+struct PinEvent {
+  uint32_t time;
+  uint8_t group;
+  uint8_t bit;
+  bool high;
+};
+
+static std::vector<PinEvent> events;
+static uint32_t maxLatency = 0;   // ticks an interrupt may be late
+
+PinLevelReg &PinLevelReg::operator=(uint32_t mask)
+{
+  for (uint8_t b = 0; b < 32; b++)
+    if (mask & (1UL << b))
+      events.push_back({simNow, group, b, high});
+  return *this;
+}
+
+void simTick()
+{
+  simNow++;
+  TcCount16 &c = tc4.COUNT16;
+  if (!c.CTRLA.bit.ENABLE)
+    return;
+  for (uint8_t ch = 0; ch < 2; ch++)
+    if ((uint16_t) simNow == c.CC[ch].reg)
+      c.INTFLAG.reg.value |= TC_INTFLAG_MC0 << ch;
+}
+
+static void run(uint32_t ticks)
+{
+  uint32_t end = simNow + ticks;
+  while ((int32_t) (end - simNow) > 0) {
+    simTick();
+    TcCount16 &c = tc4.COUNT16;
+    if (c.INTFLAG.reg & c.intEnable) {
+      uint32_t late = maxLatency ? rand() % (maxLatency + 1) : 0;
+      for (uint32_t n = 0; n < late; n++)
+        simTick();
+      TC4_Handler();
+    }
+  }
+}
+
+static void resetAll()
+{
+  memset((void *) &tc4, 0, sizeof(tc4));
+  tc4.COUNT16.INTENSET.reg.mask = tc4.COUNT16.INTENCLR.reg.mask = &tc4.COUNT16.intEnable;
+  tc4.COUNT16.INTENSET.reg.set = true;
+  tc4.COUNT16.INTENCLR.reg.set = false;
+  memset((void *) &tcc1, 0, sizeof(tcc1));
+  memset((void *) &port, 0, sizeof(port));
+  for (uint8_t g = 0; g < 2; g++) {
+    port.Group[g].OUTSET.reg.group = port.Group[g].OUTCLR.reg.group = g;
+    port.Group[g].OUTSET.reg.high = true;
+  }
+  memset((void *) servos, 0, sizeof(servos));
+  memset((void *) moves, 0, sizeof(moves));
+  memset((void *) edges, 0, sizeof(edges));
+  memset((void *) edgeCount, 0, sizeof(edgeCount));
+  memset((void *) raiseMask, 0, sizeof(raiseMask));
+  memset((void *) edgesDirty, 0, sizeof(edgesDirty));
+  memset((void *) frameStart, 0, sizeof(frameStart));
+  memset((void *) frameTicks, 0, sizeof(frameTicks));
+  memset((void *) frameMode, 0, sizeof(frameMode));
+  ServoCount = 0;
+  scheduleMode = SCHEDULE_SEQUENTIAL;
+  liveIdx = 0;
+  pending = false;
+  swapCount = 0;
+  syncedSwaps = 0;
+  swapTimer = -1;
+  holdSwap = updating = touched = false;
+  tccServo[0] = tccServo[1] = INVALID_SERVO;
+  events.clear();
+  simNow = 0;
+  maxLatency = 0;
+  srand(1);
+}
+
+struct Pulse {
+  uint32_t rise;
+  uint32_t fall;
+  uint32_t width() const { return fall - rise; }
+};
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("  FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static std::vector<Pulse> pulses(int pin, bool &paired)
+{
+  // complete pulses of the pin in time order; paired = no doubled edge
+  uint8_t group = g_APinDescription[pin].ulPort;
+  uint8_t bit = g_APinDescription[pin].ulPin;
+  std::vector<Pulse> list;
+  bool high = false;
+  uint32_t rise = 0;
+  paired = true;
+  for (const PinEvent &e : events) {
+    if (e.group != group || e.bit != bit)
+      continue;
+    if (e.high == high)
+      paired = false;
+    else if (e.high)
+      rise = e.time;
+    else
+      list.push_back({rise, e.time});
+    high = e.high;
+  }
+  return list;
+}
+
+// ---- tests ----
+
+static void testSequential()
+{
+  // 24 servos on both compare channels of TC4: exact widths, 20 ms frames
+  printf("sequential scheduling, 24 servos\n");
+  resetAll();
+  Servo s[24];
+  for (uint8_t i = 0; i < 24; i++) {
+    s[i].attach(servoPins[i]);
+    s[i].writeMicroseconds(600 + 50 * i);
+  }
+  run(10 * FRAME_TICKS);
+  for (uint8_t i = 0; i < 24; i++) {
+    bool paired;
+    std::vector<Pulse> p = pulses(servoPins[i], paired);
+    CHECK(paired, "servo %d: unpaired edges", i);
+    CHECK(p.size() >= 9, "servo %d: %d pulses in 10 frames", i, (int) p.size());
+    uint32_t ticks = usToTicks((600 + 50 * i));
+    for (size_t k = 1; k < p.size(); k++) {
+      CHECK(p[k].width() == ticks, "servo %d: width %u ticks", i, p[k].width());
+      CHECK(p[k].rise - p[k - 1].rise == FRAME_TICKS, "servo %d: period %u ticks", i, p[k].rise - p[k - 1].rise);
+    }
+  }
+}
+
+static void testBuildEdges()
+{
+  // sorted by width, edges closer than MIN_EDGE_GAP merged, every pin in exactly one edge
+  printf("edge list of simultaneous scheduling\n");
+  resetAll();
+  static const int widths[12] = {1500, 1500, 1502, 900, 2400, 1200, 1203, 1210, 600, 2000, 1800, 1499};
+  Servo s[12];
+  for (uint8_t i = 0; i < 12; i++) {
+    s[i].attach(servoPins[i]);
+    s[i].writeMicroseconds(widths[i]);
+  }
+  buildEdges(_timer1);
+  CHECK(!edgesDirty[_timer1], "edges still dirty");
+  CHECK(edgeCount[_timer1] > 0 && edgeCount[_timer1] < 12, "%d edges for 12 servos with equal widths", edgeCount[_timer1]);
+  for (uint8_t e = 1; e < edgeCount[_timer1]; e++)
+    CHECK(edges[_timer1][e].ticks - edges[_timer1][e - 1].ticks >= MIN_EDGE_GAP, "edges %d and %d: %d ticks apart", e - 1, e,
+          edges[_timer1][e].ticks - edges[_timer1][e - 1].ticks);
+  for (uint8_t i = 0; i < 12; i++) {
+    uint8_t group = g_APinDescription[servoPins[i]].ulPort;
+    uint32_t mask = 1UL << g_APinDescription[servoPins[i]].ulPin;
+    int found = 0;
+    for (uint8_t e = 0; e < edgeCount[_timer1]; e++) {
+      if (edges[_timer1][e].bitMask[group] & mask) {
+        found++;
+        uint16_t ticks = usToTicks(widths[i]);
+        CHECK(edges[_timer1][e].ticks <= ticks && ticks < edges[_timer1][e].ticks + MIN_EDGE_GAP,
+              "servo %d (%u ticks) at an edge of %u ticks", i, ticks, edges[_timer1][e].ticks);
+      }
+    }
+    CHECK(found == 1, "servo %d in %d edges", i, found);
+    CHECK(raiseMask[_timer1][group] & mask, "servo %d not raised", i);
+  }
+}
+
+static void checkSorted(const char *name, uint32_t latency)
+{
+  printf("simultaneous scheduling, 24 servos, %s\n", name);
+  resetAll();
+  maxLatency = latency;
+  Servo s[24];
+  int widths[24];
+  for (uint8_t i = 0; i < 24; i++) {
+    widths[i] = (i % 4 == 3) ? widths[i - 1] + 3 : 600 + (rand() % 1900);   // some edges merge
+    s[i].attach(servoPins[i]);
+    s[i].writeMicroseconds(widths[i]);
+  }
+  Servo::setScheduling(SCHEDULE_SIMULTANEOUS);
+  run(30 * FRAME_TICKS);
+  uint32_t slack = latency + 2 * SERVOS_PER_TIMER + EDGE_MARGIN;   // late interrupt, COUNT reads of edges done inline
+  for (uint8_t i = 0; i < 24; i++) {
+    bool paired;
+    std::vector<Pulse> p = pulses(servoPins[i], paired);
+    CHECK(paired, "servo %d: unpaired edges", i);
+    CHECK(p.size() >= 28, "servo %d: %d pulses in 30 frames", i, (int) p.size());
+    uint32_t ticks = usToTicks(widths[i]);
+    for (size_t k = 3; k < p.size(); k++) {   // from the third frame on all frames are simultaneous
+      CHECK(p[k].width() + MIN_EDGE_GAP + slack > ticks && p[k].width() <= ticks + slack,
+            "servo %d: width %u ticks for %u", i, p[k].width(), ticks);
+      CHECK(p[k].rise - p[k - 1].rise <= FRAME_TICKS + slack, "servo %d: period %u ticks", i, p[k].rise - p[k - 1].rise);
+    }
+  }
+}
+
+static void testSorted()
+{
+  checkSorted("no latency", 0);
+  checkSorted("interrupts up to 15 us late", 45);   // edges become overdue while the other channel is served
+}
+
+static void checkGroup(uint8_t mode, uint32_t phase, uint32_t commitAt)
+{
+  // servo 1 on timer 1 and servo 23 on timer 2 in one group: there is one instant before which all their
+  // pulses start with the old widths and after which all start with the new ones
+  resetAll();
+  Servo s[24];
+  for (uint8_t i = 0; i < 24; i++) {
+    if (i == 12)
+      run(phase);   // timer 2 frames start later than timer 1 frames
+    s[i].attach(servoPins[i]);
+    s[i].writeMicroseconds(700);
+  }
+  Servo::setScheduling(mode);
+  run(3 * FRAME_TICKS + commitAt);
+  Servo::beginUpdate();
+  s[1].writeMicroseconds(1300);
+  s[23].writeMicroseconds(1300);
+  Servo::commit();
+  run(3 * FRAME_TICKS);
+
+  uint32_t lastOld = 0, firstNew = UINT32_MAX;
+  const uint8_t group[2] = {1, 23};
+  for (uint8_t g = 0; g < 2; g++) {
+    bool paired;
+    std::vector<Pulse> p = pulses(servoPins[group[g]], paired);
+    CHECK(paired, "servo %d: unpaired edges", group[g]);
+    bool seenNew = false;
+    for (const Pulse &pulse : p) {
+      bool isNew = pulse.width() + MIN_EDGE_GAP > usToTicks(1300);
+      if (isNew) {
+        firstNew = min(firstNew, pulse.rise);
+        seenNew = true;
+      }
+      else {
+        CHECK(!seenNew, "servo %d: old width after a new one", group[g]);
+        lastOld = max(lastOld, pulse.rise);
+      }
+    }
+    CHECK(seenNew, "servo %d: group never applied", group[g]);
+  }
+  CHECK(lastOld < firstNew, "mode %d, phase %u, commit %u: old pulse at %u after new pulse at %u", mode, phase, commitAt,
+        lastOld, firstNew);
+  CHECK(firstNew - 1 - max(lastOld, 3 * FRAME_TICKS + commitAt) < FRAME_TICKS + usToTicks(1000), "group applied %u ticks after commit",
+        firstNew - 3 * FRAME_TICKS - commitAt);
+}
+
+static void testGroups()
+{
+  printf("group updates across both timers\n");
+  for (uint8_t mode = SCHEDULE_SEQUENTIAL; mode <= SCHEDULE_SIMULTANEOUS; mode++)
+    for (uint32_t phase = 0; phase < FRAME_TICKS; phase += FRAME_TICKS / 5)
+      for (uint32_t commitAt = 0; commitAt < FRAME_TICKS; commitAt += FRAME_TICKS / 7)
+        checkGroup(mode, phase + 1, commitAt);
+}
+
+static void testMoveInGroup()
+{
+  // a move that ends while a group is collected: the group carries its end position, no step is lost
+  printf("background move during a group update\n");
+  resetAll();
+  Servo s[2];
+  s[0].attach(servoPins[0]);
+  s[1].attach(servoPins[1]);
+  s[0].writeMicroseconds(1000);
+  s[1].writeMicroseconds(1000);
+  run(2 * FRAME_TICKS);
+  s[0].moveTo(2000, 200);
+  run(3 * FRAME_TICKS);
+  Servo::beginUpdate();
+  uint16_t frozen = LIVE_TICKS(0);
+  run(20 * FRAME_TICKS);   // the move ends meanwhile
+  CHECK(LIVE_TICKS(0) == frozen, "live buffer stepped during the group");
+  CHECK(!s[0].moving(), "move did not end");
+  s[1].writeMicroseconds(1500);
+  Servo::commit();
+  run(3 * FRAME_TICKS);
+  CHECK(s[0].readMicroseconds() == 2000, "move ended at %d us", s[0].readMicroseconds());
+  CHECK(s[1].readMicroseconds() == 1500, "group write gave %d us", s[1].readMicroseconds());
+  bool paired;
+  std::vector<Pulse> p = pulses(servoPins[0], paired);
+  CHECK(!p.empty() && p.back().width() == usToTicks(2000), "last pulse %u ticks", p.empty() ? 0 : p.back().width());
+
+  // a group holding nothing but the end of a move
+  s[0].moveTo(1200, 100);
+  Servo::beginUpdate();
+  run(10 * FRAME_TICKS);
+  Servo::commit();
+  run(2 * FRAME_TICKS);
+  CHECK(s[0].readMicroseconds() == 1200, "move ended in an empty group at %d us", s[0].readMicroseconds());
+
+  // a group begun while the last one is not applied yet joins it
+  Servo::beginUpdate();
+  s[0].writeMicroseconds(800);
+  Servo::commit();
+  Servo::beginUpdate();
+  run(2 * FRAME_TICKS);   // frame ends while the groups are joined
+  s[1].writeMicroseconds(900);
+  Servo::commit();
+  run(2 * FRAME_TICKS);
+  CHECK(s[0].readMicroseconds() == 800 && s[1].readMicroseconds() == 900, "joined groups gave %d and %d us",
+        s[0].readMicroseconds(), s[1].readMicroseconds());
+}
+
+static void checkMove(int from, int to, uint32_t duration, uint8_t profile)
+{
+  resetAll();
+  Servo s;
+  s.attach(servoPins[0]);
+  s.writeMicroseconds(from);
+  s.moveTo(to, duration, profile);
+  uint32_t frames = duration / (REFRESH_INTERVAL / 1000);
+  int32_t start = usToTicks(from), delta = (int32_t) usToTicks(to) - start;
+  int32_t last = start;
+  for (uint32_t k = 1; k <= frames; k++) {
+    CHECK(moves[0].active, "%u ms move ended after %u of %u frames", duration, k - 1, frames);
+    stepMove(0);
+    int32_t ticks = LIVE_TICKS(0);
+    CHECK(delta > 0 ? ticks >= last : ticks <= last, "%u ms move: not monotonic at frame %u", duration, k);
+    if (profile == MOVE_LINEAR) {
+      int32_t ideal = start + (int32_t) ((int64_t) delta * k / frames);
+      CHECK(abs(ticks - ideal) <= abs(delta) / 1024 + 1, "%u ms move, frame %u: %d ticks instead of %d", duration, k, ticks, ideal);
+    }
+    last = ticks;
+  }
+  CHECK(!moves[0].active, "%u ms move still active after %u frames", duration, frames);
+  uint16_t target = usToTicks(to);
+  CHECK(LIVE_TICKS(0) == target && BACK_TICKS(0) == target, "%u ms move ended at %u ticks", duration, LIVE_TICKS(0));
+}
+
+static void testMoves()
+{
+  printf("background move steps\n");
+  checkMove(1000, 2000, 1000, MOVE_LINEAR);
+  checkMove(2400, 600, 1000, MOVE_LINEAR);
+  checkMove(1000, 2000, 1000, MOVE_EASED);
+  checkMove(600, 2400, 100000, MOVE_LINEAR);   // 5000 frames: beyond 16 bit durations
+  checkMove(1500, 1510, 3000, MOVE_LINEAR);    // fewer ticks than frames
+}
+
+static void testForeignTimer()
+{
+  // a TC4 left in 8 bit mode by analogWrite() is set up again, a TC4 running for servos is shared
+  printf("timer setup\n");
+  resetAll();
+  tc4.COUNT16.CTRLA.reg = TC_CTRLA_ENABLE | TC_CTRLA_MODE_COUNT8 | TC_CTRLA_PRESCALER_DIV256;
+  Servo s[13];
+  s[0].attach(servoPins[0]);
+  CHECK((tc4.COUNT16.CTRLA.reg & TC_CTRLA_MODE_Msk) == TC_CTRLA_MODE_COUNT16, "TC4 mode not reset");
+  CHECK((tc4.COUNT16.CTRLA.reg & TC_CTRLA_PRESCALER_Msk) == TC_CTRLA_PRESCALER_DIV16, "TC4 prescaler not reset");
+  CHECK(tc4.COUNT16.READREQ.reg & TC_READREQ_RCONT, "COUNT not synchronized continuously");
+  for (uint8_t i = 1; i < 12; i++)
+    s[i].attach(servoPins[i]);
+  run(FRAME_TICKS / 3);
+  uint16_t cc0 = tc4.COUNT16.CC[0].reg;
+  s[12].attach(servoPins[12]);
+  CHECK(tc4.COUNT16.CC[0].reg == cc0 && (tc4.COUNT16.intEnable & TC_INTENSET_MC0), "timer 1 disturbed by timer 2");
+  CHECK(tc4.COUNT16.intEnable & TC_INTENSET_MC1, "timer 2 not enabled");
+}
+
+int main()
+{
+  testSequential();
+  testBuildEdges();
+  testSorted();
+  testGroups();
+  testMoveInGroup();
+  testMoves();
+  testForeignTimer();
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
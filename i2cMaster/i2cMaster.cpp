@@ -1,19 +1,549 @@
 #include "i2cMaster.h"
 
+#if defined (I2C_STATS)
+BusStats busStats;
+
+BusStats::BusStats() {
+  // initialise
+  reset();
+}
+
+void BusStats::record(uint8_t address, uint8_t command, uint32_t time, bool error) {
+  int8_t d = device(address);
+  if (d < 0) return;  // too many devices
+  uint8_t slot = (command < STATS_COMMANDS) ? command : 0;
+  uint8_t bucket = 0;
+  while (time > 1 && bucket < STATS_BUCKETS - 1) {  // log2 of time
+    time >>= 1;
+    bucket++;
+  }
+  counts[d][slot]++;
+  if (error && errors[d][slot] < 0xFFFF) errors[d][slot]++;
+  if (histogram[d][bucket] < 0xFFFF) histogram[d][bucket]++;
+}
+
+void BusStats::dump(Print &out, bool csv) {
+  if (!csv) {  // 'I', 'S', number of devices, then per device: address, counts, errors, histogram (little endian)
+    uint8_t n = 0;
+    while (n < STATS_DEVICES && addresses[n] != 0) n++;
+    out.write('I'); out.write('S'); out.write(n);
+    for (uint8_t d = 0; d < n; d++) {
+      out.write(addresses[d]);
+      out.write((const uint8_t *)counts[d], sizeof(counts[d]));
+      out.write((const uint8_t *)errors[d], sizeof(errors[d]));
+      out.write((const uint8_t *)histogram[d], sizeof(histogram[d]));
+    }
+    return;
+  }
+  out.println("address,command,count,errors");
+  for (uint8_t d = 0; d < STATS_DEVICES && addresses[d] != 0; d++) {
+    for (uint8_t c = 0; c < STATS_COMMANDS; c++) {
+      if (counts[d][c] == 0) continue;
+      out.print(addresses[d]); out.print(',');
+      out.print(c); out.print(',');
+      out.print(counts[d][c]); out.print(',');
+      out.println(errors[d][c]);
+    }
+  }
+  out.println("address,histogram 1,2,4 ... us");
+  for (uint8_t d = 0; d < STATS_DEVICES && addresses[d] != 0; d++) {
+    out.print(addresses[d]);
+    for (uint8_t i = 0; i < STATS_BUCKETS; i++) {
+      out.print(',');
+      out.print(histogram[d][i]);
+    }
+    out.println();
+  }
+}
+
+void BusStats::reset() {
+  memset(addresses, 0, sizeof(addresses));
+  memset(counts, 0, sizeof(counts));
+  memset(errors, 0, sizeof(errors));
+  memset(histogram, 0, sizeof(histogram));
+}
+
+int8_t BusStats::device(uint8_t address) {
+  for (uint8_t d = 0; d < STATS_DEVICES; d++) {
+    if (addresses[d] == address) return d;
+    if (addresses[d] == 0) {
+      addresses[d] = address;
+      return d;
+    }
+  }
+  return -1;
+}
+#endif
+
+// ------------------------------
+
+I2CQueue i2cQueue;
+
+I2CQueue::I2CQueue() {
+  // initialise
+  for (uint8_t p = 0; p < QUEUED_PRIORITIES; p++) {
+    head[p] = 0;
+    tail[p] = 0;
+    queued[p] = 0;
+  }
+  frameGap = 1000;
+  lastFrame = 0;
+  asyncMode = false;
+  maxRetries = 2;
+  retryDelayUs = 100;
+  clockHz = 100000;
+  memset(devices, 0, sizeof(devices));
+  resetStats();
+}
+
+bool I2CQueue::push(uint8_t address, byte command, int16_t value, uint8_t priority) {
+  return pushFrame(address, 0, 1, &command, &value, priority);
+}
+
+bool I2CQueue::pushFrame(uint8_t address, uint8_t version, uint8_t n, const byte *commands, const int16_t *values, uint8_t priority) {
+  uint8_t p = min(priority, QUEUED_PRIORITIES - 1);
+  n = min(n, FRAME_SIZE);
+  if (n == 0) return true;
+  bool overflow = makeRoom(p, n);
+  for (uint8_t i = 0; i < n; i++) {
+    Frame &f = frames[p][tail[p]];
+    f.address = address;
+    f.command = commands[i];
+    f.value = values[i];
+    f.batch = n - i;
+    f.version = version;
+    f.time = micros();
+    tail[p] = (tail[p] + 1) % I2C_QUEUE_SIZE;
+    queued[p]++;
+  }
+  if (asyncMode) poll();
+  else flush();
+  return !overflow;
+}
+
+void I2CQueue::poll() {
+  int8_t p;
+  while ((p = next()) >= 0 && micros() - lastFrame >= frameGap) send(p);
+}
+
+void I2CQueue::flush() {
+  int8_t p;
+  while ((p = next()) >= 0) {
+    waitGap();
+    send(p);
+  }
+}
+
+void I2CQueue::sync() {
+  flush();
+  waitGap();
+}
+
+void I2CQueue::acquire(uint8_t priority) {
+  // the bus is given at transaction boundaries only, so queued commands of higher priority go first
+  requested = micros();
+  for (uint8_t p = 0; p < min(priority, QUEUED_PRIORITIES); p++) {
+    while (queued[p] > 0) {
+      waitGap();
+      send(p);
+    }
+  }
+  acquired = micros();
+}
+
+void I2CQueue::release(uint8_t priority, uint8_t address, uint8_t command, bool error) {
+  uint32_t end = micros();
+  record(min(priority, BUS_PRIORITIES - 1), acquired, end, requested);
+  BUS_STATS(address, command, end - acquired, error);
+}
+
+void I2CQueue::setGap(uint16_t gap) {
+  frameGap = gap;
+}
+
+void I2CQueue::setAsync(bool async) {
+  asyncMode = async;
+  if (!asyncMode) flush();
+}
+
+uint8_t I2CQueue::count() {
+  uint8_t n = 0;
+  for (uint8_t p = 0; p < QUEUED_PRIORITIES; p++) n += queued[p];
+  return n;
+}
+
+uint32_t I2CQueue::transactions(uint8_t priority) {
+  return (priority < BUS_PRIORITIES) ? transactionCount[priority] : 0;
+}
+
+uint32_t I2CQueue::maxTime(uint8_t priority) {
+  return (priority < BUS_PRIORITIES) ? longestTime[priority] : 0;
+}
+
+uint32_t I2CQueue::maxWait(uint8_t priority) {
+  return (priority < BUS_PRIORITIES) ? longestWait[priority] : 0;
+}
+
+void I2CQueue::resetStats() {
+  for (uint8_t p = 0; p < BUS_PRIORITIES; p++) {
+    transactionCount[p] = 0;
+    longestTime[p] = 0;
+    longestWait[p] = 0;
+  }
+}
+
+bool I2CQueue::makeRoom(uint8_t priority, uint8_t n) {  // queue full: send old commands first
+  bool overflow = false;
+  while (queued[priority] + n > I2C_QUEUE_SIZE) {
+    waitGap();
+    send(priority);
+    overflow = true;
+  }
+  return overflow;
+}
+
+int8_t I2CQueue::next() {  // highest priority with queued commands, -1 = none
+  for (uint8_t p = 0; p < QUEUED_PRIORITIES; p++) {
+    if (queued[p] > 0) return p;
+  }
+  return -1;
+}
+
+void I2CQueue::send(uint8_t priority) {
+  uint8_t &h = head[priority];
+  uint8_t n = frames[priority][h].batch;
+  uint8_t address = frames[priority][h].address;
+  uint8_t command = frames[priority][h].command;  // a batched frame is counted for its first command
+  uint32_t queuedTime = frames[priority][h].time;
+  uint32_t start = micros();
+  uint8_t error;
+  uint8_t attempt = 0;
+  do {
+    Wire.beginTransmission(address); // transmit to device
+    if (n > 1) {  // batched frame: header, number of commands, n x 3 bytes
+      Wire.write(FRAME_HEADER | frames[priority][h].version);
+      Wire.write(n);
+    }
+    for (uint8_t i = 0; i < n; i++) {
+      Frame &f = frames[priority][(h + i) % I2C_QUEUE_SIZE];
+      Wire.write(f.command);
+      Wire.write(lowByte(f.value));
+      Wire.write(highByte(f.value));
+    }
+    error = Wire.endTransmission(); // stop transmitting and get error code
+  } while (retry(address, error, attempt++));
+  if (error) {
+    Serial.println("Error on I2C transmission");
+  }
+  h = (h + n) % I2C_QUEUE_SIZE;
+  queued[priority] -= n;
+  lastFrame = micros();
+  record(priority, start, lastFrame, queuedTime);
+  BUS_STATS(address, command, lastFrame - start, error);
+}
+
+i2cResult I2CQueue::read(uint8_t address, uint8_t *data, uint8_t n, uint8_t priority) {
+  uint8_t result;
+  uint8_t attempt = 0;
+  acquire(priority);
+  do {
+    result = (Wire.requestFrom(address, n) == n && Wire.available() == n) ? I2C_OK : I2C_SHORT_READ;
+    for (uint8_t i = 0; Wire.available(); i++) {
+      uint8_t c = Wire.read();
+      if (i < n) data[i] = c;
+    }
+  } while (retry(address, result, attempt++));
+  release(priority, address, STATS_READ, result != I2C_OK);
+  return (i2cResult)result;
+}
+
+i2cResult I2CQueue::readRegister(uint8_t address, uint8_t reg, uint8_t *data, uint8_t n, uint8_t priority) {
+  uint8_t result;
+  uint8_t attempt = 0;
+  acquire(priority);
+  do {
+    Wire.beginTransmission(address);
+    Wire.write(reg);
+    result = Wire.endTransmission(false);  // repeated start
+    if (result == I2C_OK) result = (Wire.requestFrom(address, n) == n && Wire.available() == n) ? I2C_OK : I2C_SHORT_READ;
+    for (uint8_t i = 0; Wire.available(); i++) {
+      uint8_t c = Wire.read();
+      if (i < n) data[i] = c;
+    }
+  } while (retry(address, result, attempt++));
+  release(priority, address, STATS_READ, result != I2C_OK);
+  return (i2cResult)result;
+}
+
+i2cResult I2CQueue::clearBus() {
+  // a slave holding SDA low is clocked out with up to 9 pulses on SCL, then a STOP releases the bus
+  Wire.end();
+  pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+  pinMode(PIN_WIRE_SCL, INPUT_PULLUP);
+  delayMicroseconds(5);
+  for (uint8_t i = 0; i < 9 && digitalRead(PIN_WIRE_SDA) == LOW; i++) {
+    pinMode(PIN_WIRE_SCL, OUTPUT);  // open drain: drive low or release
+    digitalWrite(PIN_WIRE_SCL, LOW);
+    delayMicroseconds(5);
+    pinMode(PIN_WIRE_SCL, INPUT_PULLUP);
+    delayMicroseconds(5);
+  }
+  pinMode(PIN_WIRE_SDA, OUTPUT);  // STOP: SDA rises while SCL is high
+  digitalWrite(PIN_WIRE_SDA, LOW);
+  delayMicroseconds(5);
+  pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+  delayMicroseconds(5);
+  bool free = (digitalRead(PIN_WIRE_SDA) == HIGH && digitalRead(PIN_WIRE_SCL) == HIGH);
+  Wire.begin();
+  Wire.setClock(clockHz);  // Wire.begin() falls back to 100 kHz
+  return free ? I2C_OK : I2C_BUS_STUCK;
+}
+
+void I2CQueue::setClock(uint32_t clock) {
+  clockHz = clock;
+  Wire.setClock(clock);
+}
+
+void I2CQueue::setRetries(uint8_t retries, uint16_t retryDelay) {
+  maxRetries = retries;
+  retryDelayUs = retryDelay;
+}
+
+const DeviceHealth *I2CQueue::health(uint8_t address) {
+  for (uint8_t d = 0; d < HEALTH_DEVICES; d++) {
+    if (devices[d].address == address) return &devices[d];
+  }
+  return NULL;
+}
+
+bool I2CQueue::retry(uint8_t address, uint8_t result, uint8_t attempt) {
+  // worst case per transaction: (retries + 1) attempts + retries * 2 * retryDelay + bus clear (~ 120 us)
+  if (result == I2C_OK) return false;
+  DeviceHealth *dev = NULL;
+  for (uint8_t d = 0; d < HEALTH_DEVICES && dev == NULL; d++) {
+    if (devices[d].address == address || devices[d].address == 0) dev = &devices[d];
+  }
+  if (dev) {
+    dev->address = address;
+    dev->errors++;
+  }
+  if (attempt >= maxRetries) {
+    if (dev) dev->failures++;
+    return false;
+  }
+  if (dev) dev->retries++;
+  if ((result == I2C_OTHER || result == I2C_TIMEOUT) && digitalRead(PIN_WIRE_SDA) == LOW) {  // a slave holds SDA
+    if (clearBus() == I2C_OK && dev) dev->recoveries++;
+  }
+  delayMicroseconds(retryDelayUs + random(retryDelayUs + 1));  // jitter against repeated collisions
+  return true;
+}
+
+void I2CQueue::waitGap() {
+  while (micros() - lastFrame < frameGap);  // slave needs time to process last command
+}
+
+void I2CQueue::record(uint8_t priority, uint32_t start, uint32_t end, uint32_t requested) {
+  transactionCount[priority]++;
+  longestTime[priority] = max(longestTime[priority], end - start);
+  longestWait[priority] = max(longestWait[priority], start - requested);
+}
+
+// ------------------------------
+
+CommandFrame::CommandFrame() {
+  // initialise
+  version = 0;
+  count = 0;
+  active = false;
+}
+
+void CommandFrame::begin() {
+  active = true;
+}
+
+bool CommandFrame::staging() {
+  return active;
+}
+
+bool CommandFrame::add(byte command, int16_t value) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (commands[i] == command) {
+      values[i] = value;
+      return true;
+    }
+  }
+  if (count >= FRAME_SIZE) return false;
+  commands[count] = command;
+  values[count] = value;
+  count++;
+  return true;
+}
+
+void CommandFrame::commit(uint8_t address) {
+  if (version == 0 || count == 1) {  // old slave firmware: single 3 byte commands
+    for (uint8_t i = 0; i < count; i++) i2cQueue.push(address, commands[i], values[i]);
+  }
+  else i2cQueue.pushFrame(address, version, count, commands, values);
+  count = 0;
+  active = false;
+}
+
+// ------------------------------
+
+MotionWatch::MotionWatch() {
+  // initialise
+  callback = NULL;
+  watching = false;
+}
+
+void MotionWatch::start(uint16_t expected, uint16_t minDelay) {
+  // sleep until shortly before the expected end, then poll with intervals shrinking towards it
+  uint32_t now = millis();
+  endTime = now + expected;
+  nextPoll = now + max(minDelay, (uint16_t)(expected - expected / 8));
+  interval = minInterval;
+  watching = true;
+}
+
+bool MotionWatch::due() {
+  return watching && (int32_t)(millis() - nextPoll) >= 0;
+}
+
+void MotionWatch::report(bool running) {
+  if (!watching) return;
+  if (running) {
+    uint32_t now = millis();
+    int32_t left = (int32_t)(endTime - now);
+    if (left > 0) nextPoll = now + constrain((uint32_t)left / 4, (uint32_t)minInterval, (uint32_t)maxInterval);
+    else {  // later than expected (or unknown): back off, the motion may be blocked
+      nextPoll = now + interval;
+      interval = min(maxInterval, (uint16_t)(interval + interval / 2 + 1));
+    }
+  }
+  else {
+    watching = false;
+    if (callback) callback();
+  }
+}
+
+bool MotionWatch::active() {
+  return watching;
+}
+
+// ------------------------------
+
+MotionProfile::MotionProfile() {
+  // initialise
+  plan(0, 0, 0, 0);
+}
+
+void MotionProfile::plan(int32_t distance, int16_t speed, int16_t accel, int16_t decel) {
+  sign = (distance < 0) ? -1 : 1;
+  dist = abs(distance);
+  a = 10.0 * abs(accel);
+  d = 10.0 * abs(decel);
+  vPeak = 10.0 * abs(speed);
+  if (dist == 0 || vPeak == 0 || a == 0 || d == 0) {
+    vPeak = 0;
+    t1 = t2 = t3 = 0;
+    return;
+  }
+  // distance = v2/2a + v2/2d: the set speed is not reached on a short move
+  float vTriangle = sqrt(2.0 * dist * a * d / (a + d));
+  if (vPeak > vTriangle) vPeak = vTriangle;
+  float sAccel = vPeak * vPeak / (2.0 * a);
+  float sDecel = vPeak * vPeak / (2.0 * d);
+  t1 = vPeak / a;
+  t2 = t1 + (dist - sAccel - sDecel) / vPeak;
+  t3 = t2 + vPeak / d;
+}
+
+uint16_t MotionProfile::accelTime() {
+  return (uint16_t)(1000.0 * t1 + 0.5);
+}
+
+uint16_t MotionProfile::cruiseTime() {
+  return (uint16_t)(1000.0 * (t2 - t1) + 0.5);
+}
+
+uint16_t MotionProfile::decelTime() {
+  return (uint16_t)(1000.0 * (t3 - t2) + 0.5);
+}
+
+uint16_t MotionProfile::totalTime() {
+  return (uint16_t)(1000.0 * t3 + 0.5);
+}
+
+int16_t MotionProfile::peakSpeed() {
+  return (int16_t)(vPeak / 10.0 + 0.5);
+}
+
+int32_t MotionProfile::decelDistance() {
+  if (d == 0) return 0;
+  return (int32_t)(vPeak * vPeak / (2.0 * d) + 0.5);
+}
+
+int32_t MotionProfile::position(uint32_t t) {
+  float s = 0.001 * t;
+  float p;
+  if (s >= t3) p = dist;
+  else if (s < t1) p = 0.5 * a * s * s;
+  else if (s < t2) p = 0.5 * a * t1 * t1 + vPeak * (s - t1);
+  else {
+    float r = t3 - s;  // time left
+    p = dist - 0.5 * d * r * r;
+  }
+  return sign * (int32_t)(p + 0.5);
+}
+
+int16_t MotionProfile::velocity(uint32_t t) {
+  float s = 0.001 * t;
+  float v;
+  if (s >= t3) v = 0;
+  else if (s < t1) v = a * s;
+  else if (s < t2) v = vPeak;
+  else v = d * (t3 - s);
+  return sign * (int16_t)(v / 10.0 + 0.5);
+}
+
+uint32_t MotionProfile::timeAt(int32_t distance) {
+  float p = abs(distance);
+  float sAccel = 0.5 * a * t1 * t1;
+  float s;
+  if (p >= dist) s = t3;
+  else if (p < sAccel) s = sqrt(2.0 * p / a);
+  else if (p < dist - 0.5 * d * (t3 - t2) * (t3 - t2)) s = t1 + (p - sAccel) / vPeak;
+  else s = t3 - sqrt(2.0 * (dist - p) / d);
+  return (uint32_t)(1000.0 * s + 0.5);
+}
+
+// ------------------------------
+
 Drivetrain::Drivetrain(const uint8_t i2c_address) {
   // initialise
   address = i2c_address;
 }
 
 void Drivetrain::sendCommand(const uint8_t command, const int16_t value) {
-  Wire.beginTransmission(address); // transmit to device
-  Wire.write(command);
-  Wire.write(lowByte(value));
-  Wire.write(highByte(value));
-  if (Wire.endTransmission()) { // stop transmitting 3 bytes and get error code
-    Serial.println("Error on I2C transmission");
+  if (!frame.staging()) i2cQueue.push(address, command, value);
+  else if (!frame.add(command, value)) {  // frame full: send it and continue staging in a new one
+    frame.commit(address);
+    frame.begin();
+    frame.add(command, value);
   }
-  delay(1);
+}
+
+void Drivetrain::setFrameVersion(uint8_t version) {
+  frame.version = version;
+}
+
+void Drivetrain::stage() {
+  frame.begin();
+}
+
+void Drivetrain::commit() {
+  frame.commit(address);
 }
 
 void Drivetrain::setAccelerations(int16_t accel, int16_t decel) {
@@ -39,6 +569,7 @@ void Drivetrain::setAccelerations() {
 
 void Drivetrain::setSpeed(int16_t speed) {
   sendCommand(SPEED, speed *20);
+  lastSpeed = speed;
 }
 
 void Drivetrain::setSteering(int16_t steering) {
@@ -47,53 +578,172 @@ void Drivetrain::setSteering(int16_t steering) {
 
 void Drivetrain::setTargetSteps(int16_t steps) {
   sendCommand(TARGET, steps);
+  lastSteps = steps;
 }
 
 void Drivetrain::go() {
+  uint16_t expected = 0;
   sendCommand(GO, 0);
+  commit();
   delay(1);
   getStatus();  // avoid initial error
+  running = true;
+  moveStart = millis();
+  profile.plan(lastSteps / 2, lastSpeed, Accel, Decel);  // 20 steps per cm
+  if (profile.totalTime() > 0) expected = 10 + profile.totalTime();
+  watch.start(expected, 10);
 }
 
 void Drivetrain::stop() {
-  sendCommand(STOP, 0);
+  i2cQueue.push(address, STOP, 0);  // never staged
 }
 
 void Drivetrain::brake() {
-  sendCommand(BRAKE, 0);
+  i2cQueue.push(address, BRAKE, 0);  // never staged
 }
 
 void Drivetrain::coast() {
-  sendCommand(COAST, 0);
+  i2cQueue.push(address, COAST, 0);  // never staged
 }
 
 int16_t Drivetrain::getStatus() {
-  Wire.requestFrom(address, 2);    // request 2 bytes from peripheral device #4
-  // delay(1);
-  uint8_t lo, hi;
-  int16_t value = -99;
-  if (Wire.available() == 2) {
-    lo = Wire.read();    // receive low byte
-    hi = Wire.read();    // receive high byte
-    value = ((0x0000 | hi) << 8) | (0x0000 | lo);
-  }
-  else value = -9;  // error code
+  int16_t value;
+  if (readStatus(value) != I2C_OK) value = -9;  // error code
   return value;
 }
 
+i2cResult Drivetrain::readStatus(int16_t &status) {
+  uint8_t data[2];  // low byte, high byte
+  i2cQueue.sync();
+  i2cResult result = i2cQueue.read(address, data, 2, PRIO_MOTOR);
+  if (result == I2C_OK) status = ((0x0000 | data[1]) << 8) | (0x0000 | data[0]);
+  return result;
+}
+
 bool Drivetrain::isRunning() {
-  return (getStatus() >= 0);
+  int16_t status;
+  if (donePin > 0) return (digitalRead(donePin) == HIGH);
+  if (readStatus(status) == I2C_OK) {
+    running = (status >= 0);
+    failedReads = 0;
+  }
+  else if (++failedReads >= MAX_FAILED_READS) running = false;  // a single lost read does not end a motion
+  return running;
 }
 
 void Drivetrain::wait() {
-  delay(10);
-  while (isRunning()) delay(1);
+  if (!watch.active()) watch.start(0, 10);
+  while (update()) delay(1);
+}
+
+bool Drivetrain::update() {
+  if (watch.due() || (donePin > 0 && watch.active())) watch.report(isRunning());
+  return watch.active();
+}
+
+void Drivetrain::onMotionDone(void (*callback)()) {
+  watch.callback = callback;
+}
+
+void Drivetrain::setDonePin(byte pin) {
+  donePin = pin;
+  if (donePin > 0) pinMode(donePin, INPUT_PULLDOWN);
 }
 
 uint16_t Drivetrain::estimateTime(int32_t distance, int16_t speed, int16_t accel, int16_t decel) {  // distance in mm, speed in cm/s, accel in cm/s2
-  int16_t v_max = (int16_t)sqrt(0.2 * abs(distance) * accel * decel / (accel + decel));
-  if (speed > v_max) speed = (int32_t)v_max;
-  return 10 + abs(100 * distance / speed) + abs(1000 * speed / accel / 2) + abs(1000 * speed / decel / 2);
+  MotionProfile p;
+  p.plan(distance, speed, accel, decel);
+  return 10 + p.totalTime();
+}
+
+MotionProfile &Drivetrain::getProfile() {
+  return profile;
+}
+
+uint32_t Drivetrain::motionTime() {
+  return millis() - moveStart;
+}
+
+bool Drivetrain::addSegment(int16_t distance, int16_t speed, int16_t steering) {
+  if (pathQueued >= PATH_SIZE) return false;
+  PathSegment &s = path[(pathHead + pathQueued) % PATH_SIZE];
+  s.distance = distance;
+  s.speed = speed;
+  s.steering = steering;
+  pathQueued++;
+  return true;
+}
+
+void Drivetrain::clearPath() {
+  pathQueued = 0;
+}
+
+uint8_t Drivetrain::pathCount() {
+  return pathQueued;
+}
+
+void Drivetrain::setLookAhead(int16_t steps) {
+  lookAhead = steps;
+}
+
+bool Drivetrain::updatePath() {
+  // the next segment is sent while the current one is still running, so the motors don't stop in between
+  int16_t status;
+  if (!pathActive) {
+    if (pathQueued == 0) return false;
+    startSegment(0);
+    pathActive = true;
+    return true;
+  }
+  if (millis() - lastPathPoll < 5) return true;
+  lastPathPoll = millis();
+  if (readStatus(status) != I2C_OK) return true;  // try again next time
+  if (status < 0) {  // stopped
+    boundarySteps = -1;
+    if (pathQueued == 0) {
+      pathActive = false;
+      return false;
+    }
+    startSegment(0);
+  }
+  else if (boundarySteps >= 0) {  // blended: the current segment keeps its steering up to its end
+    if (status > boundarySteps) boundaryArmed = true;  // a poll before the slave took the new target is ignored
+    else if (boundaryArmed) {
+      setSteering(nextSteering);
+      boundarySteps = -1;
+    }
+  }
+  else if (pathQueued > 0 && status < blendSteps() && (path[pathHead].distance < 0) == (lastSteps < 0)) {
+    startSegment(status);  // same direction: blend into the next segment
+  }
+  return true;
+}
+
+int16_t Drivetrain::blendSteps() {
+  // the slave must get the next target before it starts braking for the current one
+  int32_t steps = 2 * profile.decelDistance();  // 2 steps per mm
+  steps += profile.peakSpeed() / 5;             // covered in 10 ms of polling and sending: cm/s * 20 steps / 100
+  steps += lookAhead;
+  return (int16_t)min(steps, (int32_t)32767);
+}
+
+void Drivetrain::startSegment(int16_t stepsLeft) {
+  PathSegment &s = path[pathHead];
+  int32_t steps = (int32_t)abs(s.distance) * 20 + stepsLeft;  // 20 steps per cm
+  steps = min(steps, (int32_t)32767);
+  pathHead = (pathHead + 1) % PATH_SIZE;
+  pathQueued--;
+  stage();
+  setSpeed(s.speed);  // blended: the speed changes early, so the motors don't brake in between
+  if (stepsLeft == 0) setSteering(s.steering);
+  else {  // the steering changes at the segment boundary, else the end of the current segment is bent
+    nextSteering = s.steering;
+    boundarySteps = steps - stepsLeft;
+    boundaryArmed = false;
+  }
+  setTargetSteps((s.distance < 0) ? -steps : steps);
+  go();
+  lastPathPoll = millis();
 }
 
 // ------------------------------
@@ -104,14 +754,24 @@ MotorsX::MotorsX(const uint8_t i2c_address) {
 }
 
 void MotorsX::sendCommand(const uint8_t command, const int16_t value) {
-  Wire.beginTransmission(address); // transmit to device
-  Wire.write(command);
-  Wire.write(lowByte(value));
-  Wire.write(highByte(value));
-  if (Wire.endTransmission()) { // stop transmitting 3 bytes and get error code
-    Serial.println("Error on I2C transmission");
+  if (!frame.staging()) i2cQueue.push(address, command, value);
+  else if (!frame.add(command, value)) {  // frame full: send it and continue staging in a new one
+    frame.commit(address);
+    frame.begin();
+    frame.add(command, value);
   }
-  delay(1);
+}
+
+void MotorsX::setFrameVersion(uint8_t version) {
+  frame.version = version;
+}
+
+void MotorsX::stage() {
+  frame.begin();
+}
+
+void MotorsX::commit() {
+  frame.commit(address);
 }
 
 void MotorsX::setAccelerations_A(int16_t accel, int16_t decel) {
@@ -149,70 +809,103 @@ void MotorsX::setTargetSteps_B(int16_t steps) {
 
 void MotorsX::go_A() {
   sendCommand(GO_A, 0);
+  commit();
   delay(1);
   getStatus();  // avoid initial error
+  lastStatus |= 1;
+  watchA.start(0, 50);
 }
 
 void MotorsX::go_B() {
   sendCommand(GO_B, 0);
+  commit();
   delay(1);
   getStatus();  // avoid initial error
+  lastStatus |= 2;
+  watchB.start(0, 50);
 }
 
 void MotorsX::stop_A() {
-  sendCommand(STOP_A, 0);
+  i2cQueue.push(address, STOP_A, 0);  // never staged
 }
 
 void MotorsX::stop_B() {
-  sendCommand(STOP_B, 0);
+  i2cQueue.push(address, STOP_B, 0);  // never staged
 }
 
 void MotorsX::brake_A() {
-  sendCommand(BRAKE_A, 0);
+  i2cQueue.push(address, BRAKE_A, 0);  // never staged
 }
 
 void MotorsX::brake_B() {
-  sendCommand(BRAKE_B, 0);
+  i2cQueue.push(address, BRAKE_B, 0);  // never staged
 }
 
 void MotorsX::coast_A() {
-  sendCommand(COAST_A, 0);
+  i2cQueue.push(address, COAST_A, 0);  // never staged
 }
 
 void MotorsX::coast_B() {
-  sendCommand(COAST_B, 0);
+  i2cQueue.push(address, COAST_B, 0);  // never staged
 }
 
 int16_t MotorsX::getStatus() {
-  Wire.requestFrom(address, 2);    // request 2 bytes from peripheral device #5
-  // delay(1);
-  uint8_t lo, hi;
-  int16_t value = -99;
-  if (Wire.available() == 2) {
-    lo = Wire.read();    // receive low byte
-    hi = Wire.read();    // receive high byte
-    value = ((0x0000 | hi) << 8) | (0x0000 | lo);
-  }
-  else value = -9;  // error code
+  int16_t value;
+  if (readStatus(value) != I2C_OK) value = -9;  // error code
   return value;
 }
 
+int16_t MotorsX::runningStatus() {
+  int16_t status;
+  if (readStatus(status) == I2C_OK) {
+    lastStatus = status;
+    failedReads = 0;
+  }
+  else if (++failedReads >= MAX_FAILED_READS) lastStatus = 0;  // a single lost read does not end a motion
+  return lastStatus;
+}
+
+i2cResult MotorsX::readStatus(int16_t &status) {
+  uint8_t data[2];  // low byte, high byte
+  i2cQueue.sync();
+  i2cResult result = i2cQueue.read(address, data, 2, PRIO_MOTOR);
+  if (result == I2C_OK) status = ((0x0000 | data[1]) << 8) | (0x0000 | data[0]);
+  return result;
+}
+
 bool MotorsX::isRunning_A() {
-  return ((getStatus() & 1) == 1);
+  return ((runningStatus() & 1) == 1);
 }
 
 bool MotorsX::isRunning_B() {
-  return ((getStatus() & 2) == 2);
+  return ((runningStatus() & 2) == 2);
 }
 
 void MotorsX::wait_A() {
-  delay(50);
-  while (isRunning_A()) delay(1);
+  if (!watchA.active()) watchA.start(0, 50);
+  while (update() && watchA.active()) delay(1);
 }
 
 void MotorsX::wait_B() {
-  delay(50);
-  while (isRunning_B()) delay(1);
+  if (!watchB.active()) watchB.start(0, 50);
+  while (update() && watchB.active()) delay(1);
+}
+
+bool MotorsX::update() {
+  if (watchA.due() || watchB.due()) {  // one status read serves both motors
+    int16_t status = runningStatus();
+    if (watchA.due()) watchA.report((status & 1) == 1);
+    if (watchB.due()) watchB.report((status & 2) == 2);
+  }
+  return watchA.active() || watchB.active();
+}
+
+void MotorsX::onMotionDone_A(void (*callback)()) {
+  watchA.callback = callback;
+}
+
+void MotorsX::onMotionDone_B(void (*callback)()) {
+  watchB.callback = callback;
 }
 
 // ------------------------------
@@ -222,16 +915,107 @@ Display::Display() {
 }
 
 void Display::start() {
+  memset(wanted, ' ', sizeof(wanted));
+  memset(shown, ' ', sizeof(shown));  // display is cleared by begin()
   begin(&Adafruit128x64, 0x3c);
   displayRemap(true);
   invertDisplay(false);
   // setFont(fixed_bold10x15);  // bigger
   // setFont(font8x8);  // smaller
   setFont(X11fixed7x14B);
+  cols = min(displayWidth() / (fontWidth() + letterSpacing()), DISPLAY_COLS);  // 16 with 7 + 1 pixels
 }
 
 void Display::setRow(byte row) {
+  i2cQueue.acquire(PRIO_DISPLAY);
   setCursor(0, 2 * row - 2);
+  i2cQueue.release(PRIO_DISPLAY, 0x3c);
+}
+
+size_t Display::write(uint8_t c) {
+  i2cQueue.acquire(PRIO_DISPLAY);
+  size_t n = SSD1306AsciiWire::write(c);
+  i2cQueue.release(PRIO_DISPLAY, 0x3c);
+  return n;
+}
+
+void Display::printRow(byte row, const char *text) {
+  if (row < 1 || row > DISPLAY_ROWS) return;
+  bool end = false;
+  for (uint8_t col = 0; col < cols; col++) {
+    if (!end && text[col] == 0) end = true;  // don't read past the end of the text
+    wanted[row-1][col] = end ? ' ' : text[col];
+  }
+}
+
+bool Display::update(uint8_t chunk) {
+  // start where the last update stopped, so that no row starves
+  uint8_t written = 0;
+  int16_t lastPos = -2;  // last written character
+  uint8_t charWidth = fontWidth() + letterSpacing();
+  for (uint8_t n = 0; n < DISPLAY_ROWS * cols; n++) {
+    uint8_t row = nextRow, col = nextCol;
+    if (wanted[row][col] != shown[row][col]) {
+      if (written >= chunk) return true;
+      i2cQueue.acquire(PRIO_DISPLAY);  // motor and servo commands preempt between characters
+      if (col == 0 || row * DISPLAY_COLS + col != lastPos + 1) setCursor(col * charWidth, 2 * row);  // new run
+      SSD1306AsciiWire::write(wanted[row][col]);
+      i2cQueue.release(PRIO_DISPLAY, 0x3c);
+      shown[row][col] = wanted[row][col];
+      lastPos = row * DISPLAY_COLS + col;
+      written++;
+    }
+    if (++nextCol >= cols) {
+      nextCol = 0;
+      if (++nextRow >= DISPLAY_ROWS) nextRow = 0;
+    }
+  }
+  return false;
+}
+
+bool Display::update() {
+  return update(4);
+}
+
+// ------------------------------
+
+static const uint16_t atanTable[33] = {  // atan(i/32) in degrees * 256
+  0, 458, 916, 1371, 1824, 2273, 2719, 3159, 3593, 4021, 4443, 4856, 5262, 5660, 6049, 6429, 6801,
+  7163, 7516, 7859, 8193, 8518, 8834, 9141, 9439, 9728, 10008, 10280, 10544, 10799, 11047, 11287, 11520
+};
+
+static int32_t atanDeg256(uint32_t z) {  // z = 0 ... 32768 for 0 ... 1, result in degrees * 256
+  uint8_t i = z >> 10;
+  if (i >= 32) return atanTable[32];
+  return atanTable[i] + (((int32_t)(atanTable[i+1] - atanTable[i]) * (int32_t)(z & 0x3FF) + 512) >> 10);
+}
+
+int16_t colorHue(uint16_t _r, uint16_t _g, uint16_t _b) {
+  int32_t y = ((int32_t)_g - _b) * 28378;  // sqrt(3) * 16384
+  int32_t x = (2 * (int32_t)_r - _g - _b) * 16384;
+  uint32_t ax = (x < 0) ? -x : x;
+  uint32_t ay = (y < 0) ? -y : y;
+  uint32_t mx = max(ax, ay), mn = min(ax, ay);
+  if (mx == 0) return 0;
+  while (mx >= 0x10000) {  // scale down for 16 bit division
+    mx >>= 1;
+    mn >>= 1;
+  }
+  int32_t angle = atanDeg256((mn << 15) / mx);  // first octant 0 ... 45 degrees
+  if (ay > ax) angle = 90*256 - angle;
+  if (x < 0) angle = 180*256 - angle;
+  if (y < 0) angle = -angle;
+  return (angle >= 0) ? (angle + 128) >> 8 : -((-angle + 128) >> 8);
+}
+
+int16_t colorSaturation(uint16_t _r, uint16_t _g, uint16_t _b) {
+  uint32_t mn = min(min(_r, _g), _b);
+  uint32_t mx = max(max(max(_r, _g), _b), 1);
+  return (200 * (mx - mn) + mx) / (2 * mx);  // rounded 100 * (1 - min/max)
+}
+
+int16_t colorIntens(uint16_t _r, uint16_t _g, uint16_t _b) {
+  return (_r + _g + _b) / 3;
 }
 
 // ------------------------------
@@ -267,10 +1051,28 @@ void ColorSensorA::getRGB(uint16_t &_r, uint16_t &_g, uint16_t &_b) {
   _b = b;
 }
 
+i2cResult ColorSensorA::readBurst(uint16_t &_r, uint16_t &_g, uint16_t &_b, bool &fresh) {
+  // status and CDATA ... BDATA in one transaction; fresh = new sample since the last read
+  uint8_t data[9];
+  i2cResult result = i2cQueue.readRegister(APDS9960_I2C_ADDR, APDS9960_STATUS, data, 9, PRIO_SENSOR);
+  if (result != I2C_OK) {
+    _r = _g = _b = 0;  // as the library reads on error
+    fresh = false;
+    return result;
+  }
+  _r = ((uint16_t)data[4] << 8) | data[3];
+  _g = ((uint16_t)data[6] << 8) | data[5];
+  _b = ((uint16_t)data[8] << 8) | data[7];
+  fresh = (data[0] & APDS9960_AVALID);  // cleared by reading the data
+  return I2C_OK;
+}
+
 void ColorSensorA::getRGB() {
-  readRedLight(r);
-  readGreenLight(g);
-  readBlueLight(b);
+  bool fresh;
+  if (readBurst(r, g, b, fresh) != I2C_OK) {
+    r = g = b = 1;  // bus error: darkest value, no stale color
+    return;
+  }
   r *= 6; g *= 4; b *= 3;  // white balance
   r = max(1, r-r0);
   g = max(1, g-g0);
@@ -286,16 +1088,17 @@ void ColorSensorA::flashRGB(uint16_t &_r, uint16_t &_g, uint16_t &_b) {
 
 void ColorSensorA::flashRGB() {
   uint16_t _r0, _g0, _b0;
+  bool fresh;
   ledOff();  
-  readRedLight(_r0);
-  readGreenLight(_g0);
-  readBlueLight(_b0);
+  i2cResult dark = readBurst(_r0, _g0, _b0, fresh);
   ledOn();
   delay(5);
   _r0 *= 6; _g0 *= 4; _b0 *= 3;  // white balance
-  readRedLight(r);
-  readGreenLight(g);
-  readBlueLight(b);
+  if (dark != I2C_OK || readBurst(r, g, b, fresh) != I2C_OK) {
+    r = g = b = 1;  // bus error: darkest value, no stale color
+    ledOff();
+    return;
+  }
   r *= 6; g *= 4; b *= 3;  // white balance
   r = max(1, r-_r0);
   g = max(1, g-_g0);
@@ -303,6 +1106,118 @@ void ColorSensorA::flashRGB() {
   ledOff();
 }
 
+void ColorSensorA::startGated(byte intPin) {
+  interruptPin = intPin;
+  if (interruptPin > 0) {  // ALS interrupt after every cycle: C below 0xFFFF or above 0
+    pinMode(interruptPin, INPUT_PULLUP);  // open drain, active low
+    i2cQueue.acquire(PRIO_SENSOR);
+    setLightIntLowThreshold(0xFFFF);
+    setLightIntHighThreshold(0);
+    setAmbientLightIntEnable(1);
+    clearAmbientLightInt();
+    i2cQueue.release(PRIO_SENSOR, APDS9960_I2C_ADDR);
+  }
+  flashing = false;
+  gated = true;
+}
+
+void ColorSensorA::startFlash(uint8_t darkEvery) {
+  darkFrames = max(darkEvery, 1);
+  flashState = 0;
+  firstDark = true;
+  driftR = 0; driftG = 0; driftB = 0;
+  ledOff();
+  stopInterrupt();  // flash mode reads without it
+  flashing = true;
+  gated = true;
+}
+
+void ColorSensorA::stopSampling() {
+  stopInterrupt();
+  flashing = false;
+  gated = false;
+  ledOff();
+}
+
+void ColorSensorA::stopInterrupt() {
+  // ALS interrupt of startGated() off and released, else INT stays asserted
+  if (interruptPin > 0) {
+    i2cQueue.acquire(PRIO_SENSOR);
+    setAmbientLightIntEnable(0);
+    clearAmbientLightInt();
+    i2cQueue.release(PRIO_SENSOR, APDS9960_I2C_ADDR);
+  }
+  interruptPin = 0;
+}
+
+bool ColorSensorA::flashStep() {
+  // states: 0 = LED off, skip mixed sample; 1 = dark frame; 2 = LED on, skip mixed sample; 3 = lit frames
+  uint16_t _r, _g, _b;
+  bool fresh;
+  if (readBurst(_r, _g, _b, fresh) != I2C_OK || !fresh) return false;  // no fresh sample
+  int32_t lr = (int32_t)_r * 6, lg = (int32_t)_g * 4, lb = (int32_t)_b * 3;  // white balance
+  switch (flashState) {
+    case 0:
+    case 2:
+      flashState++;
+      return false;
+    case 1: {
+      uint32_t now = millis();
+      if (!firstDark && now != darkTime) {  // ambient drift from the last two dark frames
+        driftR = (lr - darkR) * 1000 / (int32_t)(now - darkTime);
+        driftG = (lg - darkG) * 1000 / (int32_t)(now - darkTime);
+        driftB = (lb - darkB) * 1000 / (int32_t)(now - darkTime);
+      }
+      darkR = lr; darkG = lg; darkB = lb;
+      darkTime = now;
+      firstDark = false;
+      ledOn();
+      litCount = 0;
+      flashState = 2;
+      return false;
+    }
+  }
+  int32_t dt = millis() - darkTime;  // dark value estimated for the time of the lit frame
+  r = constrain(lr - darkR - driftR * dt / 1000, 1, 65535);
+  g = constrain(lg - darkG - driftG * dt / 1000, 1, 65535);
+  b = constrain(lb - darkB - driftB * dt / 1000, 1, 65535);
+  lastSample = millis();
+  if (++litCount >= darkFrames) {
+    ledOff();
+    flashState = 0;
+  }
+  return true;
+}
+
+int32_t ColorSensorA::ambientDrift() {
+  return driftR + driftG + driftB;
+}
+
+bool ColorSensorA::update() {
+  uint16_t _r, _g, _b;
+  if (!gated) return false;
+  if (flashing) return flashStep();
+  if (interruptPin > 0 && digitalRead(interruptPin) == HIGH) return false;  // no new sample: no bus access
+  bool fresh;
+  i2cResult result = readBurst(_r, _g, _b, fresh);
+  if (interruptPin > 0) {
+    i2cQueue.acquire(PRIO_SENSOR);
+    clearAmbientLightInt();
+    i2cQueue.release(PRIO_SENSOR, APDS9960_I2C_ADDR);
+  }
+  if (result != I2C_OK || !fresh) return false;
+  _r *= 6; _g *= 4; _b *= 3;  // white balance
+  r = max(1, _r-r0);
+  g = max(1, _g-g0);
+  b = max(1, _b-b0);
+  lastSample = millis();
+  return true;
+}
+
+uint32_t ColorSensorA::sampleTime() {
+  return lastSample;
+}
+
 void ColorSensorA::calibrate() {
   uint16_t _r0, _g0, _b0;
   reset();
@@ -315,7 +1230,7 @@ void ColorSensorA::reset() {
 }
 
 int16_t ColorSensorA::hue(uint16_t _r, uint16_t _g, uint16_t _b) {
-  return round(57.3 * atan2(1.732*(_g-_b), 2*_r-_g-_b));
+  return colorHue(_r, _g, _b);
 }
 
 int16_t ColorSensorA::hue() {
@@ -323,14 +1238,7 @@ int16_t ColorSensorA::hue() {
 }
 
 int16_t ColorSensorA::color(uint16_t _r, uint16_t _g, uint16_t _b) {
-  int16_t _hue = hue(_r,_g,_b);
-  if (intens(_r,_g,_b) < blackLimit) return BLACK;
-  else if (saturation(_r,_g,_b) <= 25) return WHITE;
-  else if (_hue > -20 && _hue <= 15) return RED;
-  else if (_hue > 15  && _hue <= 90) return YELLOW;
-  else if (_hue > 90  && _hue <= 180) return GREEN;
-  else if (_hue <= -20) return BLUE;
-  else return BLACK;
+  return classifyColor<colorTableA>(_r, _g, _b, blackLimit);
 }
 
 int16_t ColorSensorA::color() {
@@ -338,9 +1246,7 @@ int16_t ColorSensorA::color() {
 }
 
 int16_t ColorSensorA::saturation(uint16_t _r, uint16_t _g, uint16_t _b) {
-  float _sat;
-  _sat = 1.0  - 1.0 * min(min(_r, _g), _b) / max(max(max(_r, _g), _b), 1);
-  return round(100 * _sat);
+  return colorSaturation(_r, _g, _b);
 }
 
 int16_t ColorSensorA::saturation() {
@@ -348,7 +1254,7 @@ int16_t ColorSensorA::saturation() {
 }
 
 int16_t ColorSensorA::intens(uint16_t _r, uint16_t _g, uint16_t _b) {
-  return (_r + _g + _b) / 3;
+  return colorIntens(_r, _g, _b);
 }
 
 int16_t ColorSensorA::intens() {
@@ -370,13 +1276,69 @@ void ColorSensorB::getRGB(uint16_t &_r, uint16_t &_g, uint16_t &_b) {
   _b = b;
 }
 
+void ColorSensorB::setProfile(uint8_t profile) {
+  if (profile == COLOR_FAST) {  // same sensitivity as COLOR_PRECISE: 24 ms * 16 ~ 101 ms * 4
+    setIntegrationTime(TCS34725_INTEGRATIONTIME_24MS);
+    setGain(TCS34725_GAIN_16X);
+  }
+  else {
+    setIntegrationTime(TCS34725_INTEGRATIONTIME_101MS);
+    setGain(TCS34725_GAIN_4X);
+  }
+  lastSample = millis();  // running integration has old settings
+}
+
+void ColorSensorB::setIntegrationTime(uint8_t it) {
+  Adafruit_TCS34725::setIntegrationTime(it);
+  integrationMs = (256 - it) * 12 / 5 + 1;  // 2.4 ms per cycle, as the library waits
+}
+
+void ColorSensorB::startContinuous() {
+  enable();  // sensor integrates continuously
+  continuous = true;
+  lastSample = millis();
+}
+
+bool ColorSensorB::update() {
+  if (!continuous) return false;
+  if (millis() - lastSample < integrationMs) return false;  // no new sample yet: no bus access
+  i2cQueue.acquire(PRIO_SENSOR);
+  bool valid = (read8(TCS34725_STATUS) & TCS34725_STATUS_AVALID);
+  if (valid) {
+    rawR = read16(TCS34725_RDATAL) * 2;  // white balance
+    rawG = read16(TCS34725_GDATAL) * 3;
+    rawB = read16(TCS34725_BDATAL) * 4;
+  }
+  i2cQueue.release(PRIO_SENSOR, TCS34725_ADDRESS, STATS_READ);
+  if (!valid) return false;
+  lastSample = millis();
+  applyDark();
+  return true;
+}
+
+uint32_t ColorSensorB::sampleTime() {
+  return lastSample;
+}
+
 void ColorSensorB::getRGB() {
-  uint16_t c;  // dummy
-  getRawData(&r, &g, &b, &c);
-  r *= 2; g *= 3; b *= 4;  // white balance
-  r = max(1, r-r0);
-  g = max(1, g-g0);
-  b = max(1, b-b0);
+  if (continuous) {
+    update();
+    applyDark();
+    return;
+  }
+  i2cQueue.acquire(PRIO_SENSOR);  // registers only: getRawData() would count its wait as bus time
+  rawR = read16(TCS34725_RDATAL) * 2;  // white balance
+  rawG = read16(TCS34725_GDATAL) * 3;
+  rawB = read16(TCS34725_BDATAL) * 4;
+  i2cQueue.release(PRIO_SENSOR, TCS34725_ADDRESS, STATS_READ);
+  delay(integrationMs);  // as getRawData(): the next call gets a new sample
+  applyDark();
+}
+
+void ColorSensorB::applyDark() {
+  r = max(1, rawR-r0);
+  g = max(1, rawG-g0);
+  b = max(1, rawB-b0);
 }
 
 void ColorSensorB::calibrate() {
@@ -391,7 +1353,7 @@ void ColorSensorB::reset() {
 }
 
 int16_t ColorSensorB::hue(uint16_t _r, uint16_t _g, uint16_t _b) {
-  return round(57.3 * atan2(1.732*(_g-_b), 2*_r-_g-_b));
+  return colorHue(_r, _g, _b);
 }
 
 int16_t ColorSensorB::hue() {
@@ -399,14 +1361,7 @@ int16_t ColorSensorB::hue() {
 }
 
 int16_t ColorSensorB::color(uint16_t _r, uint16_t _g, uint16_t _b) {
-  int16_t _hue = hue(_r,_g,_b);
-  if (intens(_r,_g,_b) < 400) return BLACK;
-  else if ((saturation(_r,_g,_b) < 20) && (intens(_r,_g,_b) > 500)) return WHITE;
-  else if (_hue > -100 && _hue <= 10) return RED;
-  else if (_hue > 10  && _hue <= 90) return YELLOW;
-  else if (_hue > -150  && _hue <= -100) return BLUE;
-  else if (_hue > 90 || _hue <= -150) return GREEN;
-  else return BLACK;
+  return classifyColor<colorTableB>(_r, _g, _b);
 }
 
 int16_t ColorSensorB::color() {
@@ -414,9 +1369,7 @@ int16_t ColorSensorB::color() {
 }
 
 int16_t ColorSensorB::saturation(uint16_t _r, uint16_t _g, uint16_t _b) {
-  float _sat;
-  _sat = 1.0  - 1.0 * min(min(_r, _g), _b) / max(max(max(_r, _g), _b), 1);
-  return round(100 * _sat);
+  return colorSaturation(_r, _g, _b);
 }
 
 int16_t ColorSensorB::saturation() {
@@ -424,7 +1377,7 @@ int16_t ColorSensorB::saturation() {
 }
 
 int16_t ColorSensorB::intens(uint16_t _r, uint16_t _g, uint16_t _b) {
-  return (_r + _g + _b) / 3;
+  return colorIntens(_r, _g, _b);
 }
 
 int16_t ColorSensorB::intens() {
@@ -435,6 +1388,7 @@ int16_t ColorSensorB::intens() {
 
 GeekservoI2C::GeekservoI2C(byte _servoPin) {  // constructor
   lastAngle = 0;
+  targetAngle = 0;
   servoPin = _servoPin;
 }
 
@@ -444,14 +1398,7 @@ int16_t GeekservoI2C::angle2pulsewidth(int16_t angle) {
 }
 
 void GeekservoI2C::sendCommand(const uint8_t command, const int16_t value) {
-  Wire.beginTransmission(i2c_address); // transmit to device
-  Wire.write(command);
-  Wire.write(lowByte(value));
-  Wire.write(highByte(value));
-  if (Wire.endTransmission()) { // stop transmitting 3 bytes and get error code
-    Serial.println("Error on I2C transmission");
-  }
-  delay(1);
+  i2cQueue.push(i2c_address, command, value, PRIO_SERVO);
 }
 
 void GeekservoI2C::turnTo(int16_t angle) {
@@ -460,24 +1407,49 @@ void GeekservoI2C::turnTo(int16_t angle) {
     case GeekB:  sendCommand(ANGLE_B, angle2pulsewidth(angle)); break;
   }
   lastAngle = angle;
+  targetAngle = angle;
 }
 
 void GeekservoI2C::slowTo(int16_t angle, uint16_t speed) {  // speed in degrees/sec
+  startSlowTo(angle, speed);
+  while (update()) delay(1);
+}
+
+void GeekservoI2C::startSlowTo(int16_t angle, uint16_t speed) {  // speed in degrees/sec
   int16_t _angle = constrain(angle, 0, maxAngle);
-  uint16_t dly = 1000 / speed;
-  if (angle > lastAngle) {
-    for (int16_t a = lastAngle; a <= angle; a ++) {
-      turnTo(a);
-      delay(dly);
-    }
+  glideTo(_angle, (uint32_t)abs(_angle - lastAngle) * 1000 / max(speed, 1), false);
+}
+
+void GeekservoI2C::glideTo(int16_t angle, uint32_t duration, bool eased) {
+  targetAngle = constrain(angle, 0, maxAngle);
+  startAngle = lastAngle;
+  moveDuration = duration;
+  moveEased = eased;
+  moveStart = millis();
+  lastCommand = moveStart - commandInterval;  // first step may be sent at once
+}
+
+bool GeekservoI2C::update() {
+  if (lastAngle == targetAngle) return false;
+  uint32_t elapsed = millis() - moveStart;
+  int16_t angle, target = targetAngle;
+  if (elapsed >= moveDuration) angle = targetAngle;
+  else {
+    uint32_t f = (elapsed < (1UL << 22)) ? (elapsed << 10) / moveDuration : elapsed / (moveDuration >> 10);  // fraction of the turn 0 ... 1024
+    if (moveEased) f = (f * f * (3072UL - 2 * f)) >> 20;  // smoothstep 3f^2 - 2f^3
+    angle = startAngle + (((int32_t)(targetAngle - startAngle) * (int32_t)f) >> 10);
   }
-  else if (angle < lastAngle) {
-    for (int16_t a = lastAngle; a >= angle; a --) {
-      turnTo(a);
-      delay(dly);
-    }
+  // one I2C command per frame at most; the target itself is always sent
+  if (angle != lastAngle && (angle == targetAngle || millis() - lastCommand >= commandInterval)) {
+    turnTo(angle);
+    targetAngle = target;  // turnTo() sets the target
+    lastCommand = millis();
   }
-  lastAngle = angle;
+  return (lastAngle != targetAngle);
+}
+
+void GeekservoI2C::setCommandInterval(uint16_t interval) {
+  commandInterval = interval;
 }
 
 void GeekservoI2C::coast() {
@@ -11,16 +11,374 @@ enum motorSCommand { NONE, GO, STOP, SPEED, STEERING, ACCEL, DECEL, TARGET, COAS
 enum motorDCommand { NONE_X, GO_A, STOP_A, SPEED_A, ACCEL_A, DECEL_A, TARGET_A, COAST_A, BRAKE_A, GO_B, STOP_B, SPEED_B, ACCEL_B, DECEL_B, TARGET_B, COAST_B, BRAKE_B };  // do not change !
 enum servoCommand  { NONE_G, ANGLE_A, DETACH_A, ANGLE_B, DETACH_B };  // do not change !
 
+/********************************************************************************/
+// Transaction statistics:
+
+//#define I2C_STATS  // <- activate to record counts, errors and latencies of all I2C transactions
+
+#if defined (I2C_STATS)
+const uint8_t STATS_DEVICES = 8;    // max. number of recorded device addresses
+const uint8_t STATS_COMMANDS = 18;  // slot 0 = other, 1 ... 16 = commands, 17 = reads
+const uint8_t STATS_READ = STATS_COMMANDS - 1;
+const uint8_t STATS_BUCKETS = 16;   // latency histogram: bucket i = 2^i ... 2^(i+1)-1 us
+
+class BusStats {
+public:
+  BusStats();  // constructor
+
+/**
+ * @brief Record one transaction of the device with command (or STATS_READ), time in us and error flag
+ */
+  void record(uint8_t address, uint8_t command, uint32_t time, bool error);
+
+/**
+ * @brief Write all statistics as CSV lines (true) or compact binary block (false)
+ */
+  void dump(Print &out, bool csv);
+
+/**
+ * @brief Reset all statistics
+ */
+  void reset();
+
+private:
+  int8_t device(uint8_t address);
+  uint8_t addresses[STATS_DEVICES];  // 0 = free
+  uint32_t counts[STATS_DEVICES][STATS_COMMANDS];
+  uint16_t errors[STATS_DEVICES][STATS_COMMANDS];
+  uint16_t histogram[STATS_DEVICES][STATS_BUCKETS];
+};
+
+extern BusStats busStats;
+#define BUS_STATS(_address, _command, _time, _error)  busStats.record(_address, _command, _time, _error)
+#else
+#define BUS_STATS(_address, _command, _time, _error)  ((void)(_address), (void)(_command), (void)(_time), (void)(_error))
+#define STATS_READ 17
+#endif
+
+/********************************************************************************/
+// Shared I2C command queue and bus arbiter:
+
+enum i2cResult { I2C_OK, I2C_TOO_LONG, I2C_NACK_ADDRESS, I2C_NACK_DATA, I2C_OTHER, I2C_TIMEOUT, I2C_SHORT_READ, I2C_BUS_STUCK };  // 0 ... 5 = Wire error codes
+
+struct DeviceHealth {
+  uint8_t address;
+  uint16_t errors;      // failed attempts
+  uint16_t retries;
+  uint16_t failures;    // transactions failed after all retries
+  uint16_t recoveries;  // stuck bus released
+};
+
+const uint8_t HEALTH_DEVICES = 8;  // max. number of devices with health counters
+const uint8_t MAX_FAILED_READS = 10;  // status reads failed in a row: motors are taken as stopped
+
+enum busPriority { PRIO_MOTOR, PRIO_SERVO, PRIO_SENSOR, PRIO_DISPLAY };  // first = highest priority
+const uint8_t BUS_PRIORITIES = 4;
+const uint8_t QUEUED_PRIORITIES = 2;  // commands of motors and servos are queued
+const uint8_t I2C_QUEUE_SIZE = 16;  // max. number of queued commands per priority
+const uint8_t FRAME_SIZE = 8;       // max. number of commands in one batched frame
+const byte FRAME_HEADER = 0xF0;     // first byte of a batched frame is FRAME_HEADER | version
+
+class I2CQueue {
+public:
+  I2CQueue();  // constructor
+
+/**
+ * @brief Queue 3 bytes for the device; sent at once unless the queue is asynchronous
+ */
+  bool push(uint8_t address, byte command, int16_t value, uint8_t priority = PRIO_MOTOR);
+
+/**
+ * @brief Queue n commands for the device as one batched frame with header and n x 3 bytes
+ */
+  bool pushFrame(uint8_t address, uint8_t version, uint8_t n, const byte *commands, const int16_t *values, uint8_t priority = PRIO_MOTOR);
+
+/**
+ * @brief Send queued commands, highest priority first, as far as the frame gap allows - call it in loop()
+ */
+  void poll();
+
+/**
+ * @brief Send all queued commands, waiting for the frame gap in between
+ */
+  void flush();
+
+/**
+ * @brief Send all queued commands and wait for the frame gap, so that the bus is ready for a read
+ */
+  void sync();
+
+/**
+ * @brief Get the bus for a direct transaction: queued commands of higher priority are sent first
+ */
+  void acquire(uint8_t priority);
+
+/**
+ * @brief Release the bus after a direct transaction with the device and record its time
+ */
+  void release(uint8_t priority, uint8_t address = 0, uint8_t command = 0, bool error = false);
+
+/**
+ * @brief Read n bytes from the device with retries
+ */
+  i2cResult read(uint8_t address, uint8_t *data, uint8_t n, uint8_t priority);
+
+/**
+ * @brief Write register number, then read n bytes from the device with retries
+ */
+  i2cResult readRegister(uint8_t address, uint8_t reg, uint8_t *data, uint8_t n, uint8_t priority);
+
+/**
+ * @brief Release a stuck bus: clock SCL until SDA is free, send STOP and restart Wire at the set clock
+ */
+  i2cResult clearBus();
+
+/**
+ * @brief Set I2C clock in Hz (default 100000) - use this instead of Wire.setClock(), so that clearBus() can restore it
+ */
+  void setClock(uint32_t clock);
+
+/**
+ * @brief Set number of retries (default 2) and delay in us before a retry (default 100, plus random jitter up to the same)
+ */
+  void setRetries(uint8_t retries, uint16_t retryDelay);
+
+/**
+ * @brief Get health counters of the device, NULL if it never had an error
+ */
+  const DeviceHealth *health(uint8_t address);
+
+/**
+ * @brief Set minimum gap between two commands in microseconds (default 1000)
+ */
+  void setGap(uint16_t gap);
+
+/**
+ * @brief Let poll() drain the queue (true) or send every command at once (false = default)
+ */
+  void setAsync(bool async);
+
+/**
+ * @brief Get number of commands waiting in the queue
+ */
+  uint8_t count();
+
+/**
+ * @brief Get number of transactions of the priority class
+ */
+  uint32_t transactions(uint8_t priority);
+
+/**
+ * @brief Get longest transaction time of the priority class in microseconds
+ */
+  uint32_t maxTime(uint8_t priority);
+
+/**
+ * @brief Get longest wait of the priority class for the bus in microseconds (e.g. latency of a STOP)
+ */
+  uint32_t maxWait(uint8_t priority);
+
+/**
+ * @brief Reset transaction statistics
+ */
+  void resetStats();
+
+private:
+  struct Frame {
+    uint8_t address;
+    byte command;
+    int16_t value;
+    uint8_t batch;  // number of commands sent in one transaction, starting with this one
+    uint8_t version;  // frame version of the batch
+    uint32_t time;  // micros() when queued
+  };
+  bool makeRoom(uint8_t priority, uint8_t n);
+  int8_t next();
+  void send(uint8_t priority);
+  bool retry(uint8_t address, uint8_t result, uint8_t attempt);
+  void waitGap();
+  void record(uint8_t priority, uint32_t start, uint32_t end, uint32_t requested);
+  Frame frames[QUEUED_PRIORITIES][I2C_QUEUE_SIZE];
+  uint8_t head[QUEUED_PRIORITIES];  // next frame to send
+  uint8_t tail[QUEUED_PRIORITIES];  // next free place
+  uint8_t queued[QUEUED_PRIORITIES];
+  uint16_t frameGap;
+  uint32_t lastFrame;  // micros() of last transmission
+  bool asyncMode;
+  uint32_t transactionCount[BUS_PRIORITIES];
+  uint32_t longestTime[BUS_PRIORITIES];
+  uint32_t longestWait[BUS_PRIORITIES];
+  uint32_t acquired;   // micros() when the bus was given to a direct transaction
+  uint32_t requested;  // micros() when it was requested
+  uint8_t maxRetries;
+  uint16_t retryDelayUs;
+  uint32_t clockHz;
+  DeviceHealth devices[HEALTH_DEVICES];
+};
+
+extern I2CQueue i2cQueue;
+
+/********************************************************************************/
+// Staged commands for a batched frame:
+
+class CommandFrame {
+public:
+  CommandFrame();  // constructor
+
+/**
+ * @brief Start collecting commands instead of sending them
+ */
+  void begin();
+
+/**
+ * @brief Get information if commands are collected
+ */
+  bool staging();
+
+/**
+ * @brief Collect command; a later value of the same command replaces the collected one - false if the frame is full
+ */
+  bool add(byte command, int16_t value);
+
+/**
+ * @brief Send collected commands to the device as one frame, or one by one for frame version 0
+ */
+  void commit(uint8_t address);
+
+  uint8_t version;  // 0 = single 3 byte commands (old slave firmware), 1 = batched frames
+private:
+  byte commands[FRAME_SIZE];
+  int16_t values[FRAME_SIZE];
+  uint8_t count;
+  bool active;
+};
+
+/********************************************************************************/
+// Adaptive status polling for motion completion:
+
+class MotionWatch {
+public:
+  MotionWatch();  // constructor
+
+/**
+ * @brief Start watching a motion; first status read after expected time (ms, 0 = unknown) or minDelay ms
+ */
+  void start(uint16_t expected, uint16_t minDelay);
+
+/**
+ * @brief Get information if the next status read is due
+ */
+  bool due();
+
+/**
+ * @brief Report result of the status read; schedules the next read or finishes the motion
+ */
+  void report(bool running);
+
+/**
+ * @brief Get information if the motion is still watched
+ */
+  bool active();
+
+  void (*callback)();  // called once when the motion is done
+  uint16_t minInterval = 2;   // ms between status reads at the expected end
+  uint16_t maxInterval = 20;  // ms between status reads far from it
+private:
+  uint32_t nextPoll;
+  uint32_t endTime;  // millis() of the expected end
+  uint16_t interval;
+  bool watching;
+};
+
+/********************************************************************************/
+// Trapezoidal motion profile (triangular for short moves):
+
+class MotionProfile {
+public:
+  MotionProfile();  // constructor
+
+/**
+ * @brief Plan a move: distance in mm, speed in cm/s, accel and decel in cm/s2
+ */
+  void plan(int32_t distance, int16_t speed, int16_t accel, int16_t decel);
+
+/**
+ * @brief Get duration of acceleration, constant speed, deceleration and the whole move in ms
+ */
+  uint16_t accelTime();
+  uint16_t cruiseTime();
+  uint16_t decelTime();
+  uint16_t totalTime();
+
+/**
+ * @brief Get highest speed in cm/s - lower than the requested speed for a triangular profile
+ */
+  int16_t peakSpeed();
+
+/**
+ * @brief Get distance in mm needed to brake from the peak speed
+ */
+  int32_t decelDistance();
+
+/**
+ * @brief Get distance in mm covered after t ms
+ */
+  int32_t position(uint32_t t);
+
+/**
+ * @brief Get speed in cm/s after t ms
+ */
+  int16_t velocity(uint32_t t);
+
+/**
+ * @brief Get time in ms when the distance in mm is reached
+ */
+  uint32_t timeAt(int32_t distance);
+
+private:
+  float a, d;      // mm/s2
+  float vPeak;     // mm/s
+  float t1, t2, t3;  // end of acceleration, cruise and deceleration in s
+  float dist;      // mm
+  int8_t sign;
+};
+
+/********************************************************************************/
+// Path segments for Drivetrain:
+
+const uint8_t PATH_SIZE = 8;  // max. number of queued segments
+
+struct PathSegment {
+  int16_t distance;  // cm, negative = backwards
+  int16_t speed;     // cm/s
+  int16_t steering;  // -100 ... +100
+};
+
 /********************************************************************************/
 class Drivetrain {
 public:
   Drivetrain(const uint8_t i2c_address);  // constructor
   
 /**
- * @brief Send 3 bytes over I2C bus
+ * @brief Send 3 bytes over I2C bus via i2cQueue
  */
   void sendCommand(byte command, int16_t value);
   
+/**
+ * @brief Use batched frames (1) or single 3 byte commands (0 = default for old slave firmware)
+ */
+  void setFrameVersion(uint8_t version);
+  
+/**
+ * @brief Collect the following commands until commit() or go()
+ */
+  void stage();
+  
+/**
+ * @brief Send the collected commands in one I2C transaction
+ */
+  void commit();
+  
 /**
  * @brief Set acceleration and deceleration in cm/s2
  */
@@ -57,7 +415,7 @@ public:
   void go();
   
 /**
- * @brief Stop motors
+ * @brief Stop motors - sent at once, also while staging
  */
   void stop();
   
@@ -72,10 +430,15 @@ public:
   void coast();
   
 /**
- * @brief Get status word from motor control: steps left or -1 if stopped
+ * @brief Get status word from motor control: steps left or -1 if stopped, -9 = error
  */
   int16_t getStatus();
   
+/**
+ * @brief Read status word from motor control with retries - returns I2C_OK or error
+ */
+  i2cResult readStatus(int16_t &status);
+  
 /**
  * @brief Get information if motors are still running
  */
@@ -86,11 +449,61 @@ public:
  */
   void wait();
   
+/**
+ * @brief Watch the motion without blocking - returns false when motors are done; call it in loop()
+ */
+  bool update();
+  
+/**
+ * @brief Set function to be called by update() or wait() when the motion is done
+ */
+  void onMotionDone(void (*callback)());
+  
+/**
+ * @brief Use a pin driven HIGH by the motor control while running instead of status reads
+ */
+  void setDonePin(byte pin);
+  
 /**
 
  * @brief Estimate the total running time in milliseconds
  */
   uint16_t estimateTime(int32_t distance, int16_t speed, int16_t accel, int16_t decel);
+  
+/**
+ * @brief Get the profile planned by the last go()
+ */
+  MotionProfile &getProfile();
+  
+/**
+ * @brief Get milliseconds since the last go()
+ */
+  uint32_t motionTime();
+  
+/**
+ * @brief Queue a path segment: distance in cm, speed in cm/s, steering -100 ... +100; false if the queue is full
+ */
+  bool addSegment(int16_t distance, int16_t speed, int16_t steering);
+  
+/**
+ * @brief Drop all queued segments; a running segment is finished
+ */
+  void clearPath();
+  
+/**
+ * @brief Get number of queued segments not yet sent
+ */
+  uint8_t pathCount();
+  
+/**
+ * @brief Set margin in steps added to the braking distance at which the next segment is sent (default 10)
+ */
+  void setLookAhead(int16_t steps);
+  
+/**
+ * @brief Stream the queued segments without blocking - returns false when the path is done; call it in loop()
+ */
+  bool updatePath();
 
   int16_t Accel;
   int16_t Decel;
@@ -98,6 +511,26 @@ public:
   const int16_t ACCELMAX = 200;  // cm/s2  max 500
 private:
   byte address;
+  CommandFrame frame;
+  MotionWatch watch;
+  byte donePin = 0;
+  int16_t lastSpeed = 0;  // cm/s
+  int16_t lastSteps = 0;
+  MotionProfile profile;
+  uint32_t moveStart = 0;
+  void startSegment(int16_t stepsLeft);
+  int16_t blendSteps();
+  PathSegment path[PATH_SIZE];
+  uint8_t pathHead = 0;
+  uint8_t pathQueued = 0;
+  bool pathActive = false;
+  int16_t lookAhead = 10;
+  int16_t boundarySteps = -1;  // steps left at the start of a blended segment, -1 = no steering switch waiting
+  bool boundaryArmed = false;  // the slave reported the extended target
+  int16_t nextSteering = 0;    // steering of the blended segment
+  uint32_t lastPathPoll = 0;
+  bool running = false;  // last valid status
+  uint8_t failedReads = 0;
 };
 
 /********************************************************************************/
@@ -106,10 +539,25 @@ public:
   MotorsX(const uint8_t i2c_address);  // constructor
   
 /**
- * @brief Send 3 bytes over I2C bus
+ * @brief Send 3 bytes over I2C bus via i2cQueue
  */
   void sendCommand(byte command, int16_t value);
   
+/**
+ * @brief Use batched frames (1) or single 3 byte commands (0 = default for old slave firmware)
+ */
+  void setFrameVersion(uint8_t version);
+  
+/**
+ * @brief Collect the following commands until commit() or go_A/B()
+ */
+  void stage();
+  
+/**
+ * @brief Send the collected commands in one I2C transaction
+ */
+  void commit();
+  
 /**
  * @brief Set acceleration and deceleration for motor A in degrees/s2
  */
@@ -156,12 +604,12 @@ public:
   void go_B();
   
 /**
- * @brief Stop motor A
+ * @brief Stop motor A - sent at once, also while staging
  */
   void stop_A();
   
 /**
- * @brief Stop motor B
+ * @brief Stop motor B - sent at once, also while staging
  */
   void stop_B();
   
@@ -186,10 +634,15 @@ public:
   void coast_B();
   
 /**
- * @brief Get status word from motor control: 0 = both off, +1 A on, +2 B on
+ * @brief Get status word from motor control: 0 = both off, +1 A on, +2 B on, -9 = error
  */
   int16_t getStatus();
 
+/**
+ * @brief Read status word from motor control with retries - returns I2C_OK or error
+ */
+  i2cResult readStatus(int16_t &status);
+
 /**
  * @brief Get information if motor A is still running
  */
@@ -210,9 +663,30 @@ public:
  */
   void wait_B();
 
+/**
+ * @brief Watch both motors without blocking - returns false when both are done; call it in loop()
+ */
+  bool update();
+
+/**
+ * @brief Set function to be called when the motion of motor A is done
+ */
+  void onMotionDone_A(void (*callback)());
+
+/**
+ * @brief Set function to be called when the motion of motor B is done
+ */
+  void onMotionDone_B(void (*callback)());
+
   const int16_t ACCELMAX = 10000;  // deg/s2
 private:
   byte address;
+  CommandFrame frame;
+  MotionWatch watchA;
+  MotionWatch watchB;
+  int16_t runningStatus();
+  int16_t lastStatus = 0;  // last valid status
+  uint8_t failedReads = 0;
 };
 
 /********************************************************************************/
@@ -221,6 +695,9 @@ private:
 #include <SSD1306Ascii.h>
 #include <SSD1306AsciiWire.h>
 
+const uint8_t DISPLAY_ROWS = 4;
+const uint8_t DISPLAY_COLS = 18;  // max. characters per row in the shadow buffer; used: display width / character width
+
 class Display : public SSD1306AsciiWire {
 public:
   Display();  // constructor
@@ -234,15 +711,92 @@ public:
  * @brief Set row 1 ... 4 for next print operation
  */
   void setRow(byte row);
+
+/**
+ * @brief Write a character at the cursor - print() goes through here, so motor and servo commands preempt between characters
+ */
+  size_t write(uint8_t c);
+  using Print::write;
+  
+/**
+ * @brief Write text to row 1 ... 4 of the shadow buffer - update() shows the changes
+ */
+  void printRow(byte row, const char *text);
+  
+/**
+ * @brief Write up to chunk changed characters to the display - returns true if more are pending; call it in loop()
+ */
+  bool update(uint8_t chunk);
+  bool update();  // default 4 characters
+  
+private:
+  char wanted[DISPLAY_ROWS][DISPLAY_COLS];  // shadow buffer
+  char shown[DISPLAY_ROWS][DISPLAY_COLS];   // characters on the display
+  uint8_t nextRow = 0;  // position of the next dirty check
+  uint8_t nextCol = 0;
+  uint8_t cols = DISPLAY_COLS;  // characters fitting in a row with the current font
 };
 
+/********************************************************************************/
+// Integer color math for both color sensors (no FPU on Cortex-M0+):
+
+/**
+ * @brief Calculate the hue value (-179 ... +180 ; HSL color model) with integer atan2, error max. 1 degree
+ */
+int16_t colorHue(uint16_t _r, uint16_t _g, uint16_t _b);
+
+/**
+ * @brief Calculate the saturation (0 ... 100) with integer division
+ */
+int16_t colorSaturation(uint16_t _r, uint16_t _g, uint16_t _b);
+
+/**
+ * @brief Calculate the reflection intensity
+ */
+int16_t colorIntens(uint16_t _r, uint16_t _g, uint16_t _b);
+
 /********************************************************************************/
 // APDS 9960 color sensor:
 
 #include <SparkFun_APDS9960.h>
 
-enum colors { BLACK, RED, YELLOW, GREEN, BLUE, WHITE };  // do not change !
-enum colors_de { SCHWARZ, ROT, GELB, GRUEN, BLAU, WEISS };  // do not change !
+enum colors { BLACK, RED, YELLOW, GREEN, BLUE, WHITE, ORANGE, PURPLE };  // do not change ! (new colors at the end)
+enum colors_de { SCHWARZ, ROT, GELB, GRUEN, BLAU, WEISS, LILA = PURPLE };  // do not change ! (ORANGE is the same word in both)
+
+struct HueBand {
+  int16_t from;  // from < hue <= to
+  int16_t to;
+  uint8_t color;
+};
+
+struct ColorThresholds {
+  uint16_t black;        // intensity below: BLACK
+  uint8_t whiteSat;      // saturation below ...
+  uint16_t whiteIntens;  // ... and intensity from: WHITE
+  const HueBand *bands;  // first matching hue band gives the color, none: BLACK
+  uint8_t bandCount;
+};
+
+constexpr HueBand hueBandsA[] = { {-20, 15, RED}, {15, 90, YELLOW}, {90, 180, GREEN}, {-181, -20, BLUE} };  // -180 is a valid hue
+constexpr ColorThresholds colorTableA = { 40, 26, 0, hueBandsA, sizeof(hueBandsA) / sizeof(HueBand) };
+
+constexpr HueBand hueBandsB[] = { {-100, 10, RED}, {10, 90, YELLOW}, {-150, -100, BLUE}, {90, 180, GREEN}, {-181, -150, GREEN} };
+constexpr ColorThresholds colorTableB = { 400, 20, 501, hueBandsB, sizeof(hueBandsB) / sizeof(HueBand) };
+
+/**
+ * @brief Calculate the color code from the given RGB values with the threshold table T
+ */
+template <const ColorThresholds &T>
+int16_t classifyColor(uint16_t _r, uint16_t _g, uint16_t _b, uint16_t blackLimit = T.black) {
+  int16_t _intens = colorIntens(_r, _g, _b);  // hue, saturation and intensity only once
+  if (_intens < blackLimit) return BLACK;
+  if (colorSaturation(_r, _g, _b) < T.whiteSat && _intens >= T.whiteIntens) return WHITE;
+  int16_t _hue = colorHue(_r, _g, _b);
+  for (uint8_t i = 0; i < T.bandCount; i++) {
+    if (_hue > T.bands[i].from && _hue <= T.bands[i].to) return T.bands[i].color;
+  }
+  return BLACK;
+}
 
 class ColorSensorA : public SparkFun_APDS9960 {
 public:
@@ -287,6 +841,36 @@ public:
  */
   void flashRGB();
   
+/**
+ * @brief Start sampling only fresh values: on ALS interrupt at intPin, or by status check (intPin = 0)
+ */
+  void startGated(byte intPin);
+  
+/**
+ * @brief Start pipelined differential measurement; one dark frame for darkEvery lit frames
+ */
+  void startFlash(uint8_t darkEvery);
+  
+/**
+ * @brief Stop gated or pipelined sampling and switch LEDs off
+ */
+  void stopSampling();
+  
+/**
+ * @brief Fetch a new sample if the sensor has one - returns true if r,g,b were updated; call it in loop()
+ */
+  bool update();
+  
+/**
+ * @brief Get time stamp (millis) of the latest sample
+ */
+  uint32_t sampleTime();
+  
+/**
+ * @brief Get estimated change of the dark value r+g+b per second in pipelined measurement
+ */
+  int32_t ambientDrift();
+  
 /**
  * @brief Measure dark RGB values and store to variables r0,g0,b0
  */
@@ -339,9 +923,23 @@ public:
 
   uint16_t r, g, b;
   uint16_t r0 = 0, g0 = 0, b0 = 0;  // dark values
-  uint16_t blackLimit = 40;
+  uint16_t blackLimit = colorTableA.black;
 private:
+  i2cResult readBurst(uint16_t &_r, uint16_t &_g, uint16_t &_b, bool &fresh);
+  bool flashStep();
+  void stopInterrupt();
   byte ledPin;
+  byte interruptPin = 0;
+  bool gated = false;
+  uint32_t lastSample = 0;  // millis()
+  bool flashing = false;
+  uint8_t flashState;  // see flashStep()
+  uint8_t darkFrames;  // lit frames per dark frame
+  uint8_t litCount;
+  int32_t darkR, darkG, darkB;     // last dark frame, white balanced
+  int32_t driftR, driftG, driftB;  // change of dark frame per second
+  uint32_t darkTime;  // millis() of last dark frame
+  bool firstDark;
 };
 
 /********************************************************************************/
@@ -349,6 +947,8 @@ private:
 
 #include "Adafruit_TCS34725.h"
 
+enum colorProfiles { COLOR_PRECISE, COLOR_FAST };
+
 class ColorSensorB : public Adafruit_TCS34725 {
 public:
   
@@ -357,13 +957,38 @@ public:
  */
   void start();
   
+/**
+ * @brief Select COLOR_PRECISE (101 ms, gain 4x = default) or COLOR_FAST (24 ms, gain 16x)
+ */
+  void setProfile(uint8_t profile);
+  
+/**
+ * @brief Set integration time (TCS34725_INTEGRATIONTIME_...) - hides the library function, so getRGB() and update() wait the right time
+ */
+  void setIntegrationTime(uint8_t it);
+  
+/**
+ * @brief Start continuous acquisition - getRGB() and update() do not wait anymore
+ */
+  void startContinuous();
+  
+/**
+ * @brief Fetch a new sample if the sensor has one - returns true if r,g,b were updated; call it in loop()
+ */
+  bool update();
+  
+/**
+ * @brief Get time stamp (millis) of the latest sample
+ */
+  uint32_t sampleTime();
+  
 /**
  * @brief Measure and write RGB values to the 3 variables in parenthesis
  */
   void getRGB(uint16_t &_r, uint16_t &_g, uint16_t &_b);
   
 /**
- * @brief Measure and write RGB values to the instance variables r,g,b
+ * @brief Measure and write RGB values to the instance variables r,g,b; latest sample in continuous mode
  */
   void getRGB();
   
@@ -419,6 +1044,12 @@ public:
 
   uint16_t r, g, b;
   uint16_t r0 = 0, g0 = 0, b0 = 0;  // dark values
+private:
+  void applyDark();
+  bool continuous = false;
+  uint16_t integrationMs = 101;
+  uint16_t rawR = 0, rawG = 0, rawB = 0;  // white balanced sample
+  uint32_t lastSample = 0;  // millis()
 };
 
 /********************************************************************************/
@@ -433,7 +1064,7 @@ public:
   GeekservoI2C(byte _servoPin);  // constructor ;_servoPin = 5 or 3
 
 /**
- * @brief Send 3 bytes over I2C bus
+ * @brief Send 3 bytes over I2C bus via i2cQueue
  */
   void sendCommand(byte command, int16_t value);
     
@@ -447,6 +1078,26 @@ public:
  */
   void slowTo(int16_t angle, uint16_t speed);
   
+/**
+ * @brief Start turning servo to degrees (absolutely) slowly with speed degrees/s - does not wait
+ */
+  void startSlowTo(int16_t angle, uint16_t speed);
+  
+/**
+ * @brief Start turning servo to degrees (absolutely) within duration ms, eased = smooth start and stop - does not wait
+ */
+  void glideTo(int16_t angle, uint32_t duration, bool eased = true);
+  
+/**
+ * @brief Continue slow turn - returns false when target is reached; call it in loop()
+ */
+  bool update();
+  
+/**
+ * @brief Set minimum time between two angle commands in ms during a turn (default 20 = one servo frame)
+ */
+  void setCommandInterval(uint16_t interval);
+  
 /**
  * @brief Let servo coast - turn current off
  */
@@ -455,6 +1106,13 @@ public:
 private:
   int16_t angle2pulsewidth(int16_t angle);
   int16_t lastAngle;
+  int16_t targetAngle;
+  int16_t startAngle;
+  uint32_t moveDuration;  // ms
+  bool moveEased;
+  uint32_t moveStart;
+  uint16_t commandInterval = 20;
+  uint32_t lastCommand;  // millis()
   const uint8_t i2c_address = 6;
   byte servoPin;  // 5 or 3
   int16_t maxAngle = 360;